@@ -1,21 +1,51 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
 #include <iostream>
 #include <fstream>
+#include <map>
+#include <mutex>
+#include <new>
 #include <string>
+#include <thread>
 #include <tuple>
 #include <vector>
 
 #include <assert.h>
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <limits.h>
+#include <poll.h>
+#include <regex.h>
 #include <ncursesw/curses.h>
 #include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <time.h>
+#include <wchar.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
 
 #define KEY_CTRL_LEFT  545
 #define KEY_CTRL_RIGHT 560
 #define KEY_CTRL_HOME  535
 #define KEY_CTRL_END   530
+#define KEY_PASTE_BEGIN 0x1000  // bracketed paste markers, see define_key()
+#define KEY_PASTE_END   0x1001
 #define MOUSE_SCROLL_UP(e)    ((e) & 0x00010000)
 #define MOUSE_SCROLL_DN(e)    ((e) & 0x00200000)
 
@@ -29,345 +59,4728 @@ uint64_t file_get_size(FILE* fh) {
   return file_size;
 }
 
+uint8_t* file_map(FILE* fh, uint64_t size, bool& mapped) {
+  // Map the file read-only so that only the pages we actually touch are
+  // read in, and share the page cache with everyone else reading the file.
+  // Lines that are never edited point straight into the mapping.
+  mapped = false;
+  if (size == 0) {
+    return nullptr;
+  }
+  void* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fileno(fh), 0);
+  if (map != MAP_FAILED) {
+    mapped = true;
+    return (uint8_t*)map;
+  }
+
+  // not everything can be mapped (pipes, some special files), so fall back
+  // to reading the whole thing in
+  uint8_t* buffer = new uint8_t[size];
+  fseek(fh, 0, SEEK_SET);
+  if (fread(buffer, 1, size, fh) != size) {
+    delete[] buffer;
+    return nullptr;
+  }
+  return buffer;
+}
+
+// Edit buffers come from their own allocator rather than new[].  Requests
+// are rounded up to a size class (four per power of two, so at most a
+// quarter is lost to rounding), and each thread keeps a free list per class
+// so allocating or freeing on the keystroke path never takes a lock.  Fresh
+// blocks are bump-allocated out of slabs, which are cut from large chunks
+// mapped from the OS.  Buffers too big for a class are mapped on their own.
+class EditArena {
+public:
+  static const uint64_t MIN_CLASS = 16;
+  static const uint64_t MAX_CLASS = 64 * 1024;
+  static const int CLASSES = 49;  // class_index(MAX_CLASS) + 1
+  static const uint64_t SLAB_SIZE = 256 * 1024;
+  static const uint64_t CHUNK_SIZE = 4 * 1024 * 1024;
+
+  static std::atomic<uint64_t> small_live;  // bytes handed out from slabs
+  static std::atomic<uint64_t> large_live;  // bytes in buffers mapped on their own
+  static std::atomic<uint64_t> slab_bytes;
+  static std::atomic<uint64_t> slabs;
+
+  static uint8_t* alloc(uint64_t& capacity) {
+    // capacity is rounded up to what was actually allocated
+    if (capacity > MAX_CLASS) {
+      capacity = (capacity + 4095) & ~(uint64_t)4095;
+      void* p = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) {
+        abort();
+      }
+      large_live += capacity;
+      return (uint8_t*)p;
+    }
+    int c = class_index(capacity);
+    capacity = class_size(c);
+    small_live += capacity;
+    ThreadCache& cache = thread_cache;
+    if (!cache.free[c]) {
+      refill(cache, c);
+    }
+    FreeBlock* block = cache.free[c];
+    if (block) {
+      cache.free[c] = block->next;
+      return (uint8_t*)block;
+    }
+    if (cache.bump[c] == cache.bump_end[c]) {
+      new_slab(cache, c);
+    }
+    uint8_t* p = cache.bump[c];
+    cache.bump[c] += capacity;
+    return p;
+  }
+
+  static void free(uint8_t* p, uint64_t capacity) {
+    if (capacity > MAX_CLASS) {
+      munmap(p, capacity);
+      large_live -= capacity;
+      return;
+    }
+    int c = class_index(capacity);
+    assert(class_size(c) == capacity);
+    small_live -= capacity;
+    FreeBlock* block = (FreeBlock*)p;
+    block->next = thread_cache.free[c];
+    thread_cache.free[c] = block;
+  }
+
+  static int class_index(uint64_t size) {
+    if (size <= MIN_CLASS) {
+      return 0;
+    }
+    int p = 63 - __builtin_clzll(size - 1);  // 2^p < size <= 2^(p+1)
+    uint64_t k = ((size - 1) - ((uint64_t)1 << p)) / ((uint64_t)1 << (p - 2)) + 1;
+    return (p - 4) * 4 + k;
+  }
+
+  static uint64_t class_size(int c) {
+    if (c == 0) {
+      return MIN_CLASS;
+    }
+    int p = 4 + (c - 1) / 4;
+    uint64_t k = (c - 1) % 4 + 1;
+    return ((uint64_t)1 << p) + k * ((uint64_t)1 << (p - 2));
+  }
+
+private:
+  struct FreeBlock {
+    FreeBlock* next;
+  };
+
+  struct ThreadCache {
+    FreeBlock* free[CLASSES];
+    uint8_t* bump[CLASSES];
+    uint8_t* bump_end[CLASSES];
+    ThreadCache() {
+      memset(this, 0, sizeof(*this));
+    }
+    ~ThreadCache() {
+      // hand everything this thread still holds to whoever comes next
+      std::lock_guard<std::mutex> lock(mutex);
+      for (int c = 0; c < CLASSES; c++) {
+        for (; bump[c] < bump_end[c]; bump[c] += class_size(c)) {
+          FreeBlock* block = (FreeBlock*)bump[c];
+          block->next = free[c];
+          free[c] = block;
+        }
+        while (free[c]) {
+          FreeBlock* block = free[c];
+          free[c] = block->next;
+          block->next = orphans[c];
+          orphans[c] = block;
+          have_orphans = true;
+        }
+      }
+    }
+  };
+
+  static thread_local ThreadCache thread_cache;
+  static std::mutex mutex;
+  static FreeBlock* orphans[CLASSES];  // blocks left behind by exited threads
+  static std::atomic<bool> have_orphans;
+  static uint8_t* chunk;
+  static uint8_t* chunk_end;
+
+  static void refill(ThreadCache& cache, int c) {
+    if (!have_orphans) {
+      return;
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    cache.free[c] = orphans[c];
+    orphans[c] = nullptr;
+  }
+
+  static void new_slab(ThreadCache& cache, int c) {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (chunk == chunk_end) {
+      void* p = mmap(nullptr, CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED) {
+        abort();
+      }
+      chunk = (uint8_t*)p;
+      chunk_end = chunk + CHUNK_SIZE;
+    }
+    uint64_t size = class_size(c);
+    cache.bump[c] = chunk;
+    cache.bump_end[c] = chunk + SLAB_SIZE / size * size;
+    chunk += SLAB_SIZE;
+    slab_bytes += SLAB_SIZE;
+    slabs++;
+  }
+};
+
+std::atomic<uint64_t> EditArena::small_live(0);
+std::atomic<uint64_t> EditArena::large_live(0);
+std::atomic<uint64_t> EditArena::slab_bytes(0);
+std::atomic<uint64_t> EditArena::slabs(0);
+thread_local EditArena::ThreadCache EditArena::thread_cache;
+std::mutex EditArena::mutex;
+EditArena::FreeBlock* EditArena::orphans[EditArena::CLASSES];
+std::atomic<bool> EditArena::have_orphans(false);
+uint8_t* EditArena::chunk = nullptr;
+uint8_t* EditArena::chunk_end = nullptr;
+
+// Edited lines are gap buffers: the text is front() followed by back(), with
+// the gap in between sitting wherever the last edit happened, so typing or
+// deleting at the cursor only moves bytes when the cursor moves.  Lines that
+// still point into the original file buffer have no gap; all of their text
+// is front(), and that text is never written to.
+//
+// Edit buffers are reference counted, so cutting, pasting and duplicating
+// a line never copies its text: every copy of a LineMeta made with share()
+// holds a reference and has to release() it when it is dropped.  A buffer
+// is only written through a line holding the one and only reference;
+// make_gap() copies a shared buffer out first.
 struct LineMeta {
 public:
+  static const uint64_t EDIT_HEADER_SIZE = 8;  // the reference count
+
   uint8_t* start;
   uint64_t size;
   uint64_t capacity;  // 0 if using original file buffer
+  uint64_t gap;       // offset of the gap in an edit buffer
 public:
-  bool has_edit_buffer() {
+  bool has_edit_buffer() const {
     return capacity > 0;
   }
-  void alloc_edit_buffer() {
-    bool delete_old_buffer = (capacity > 0);  // need to be careful not to delete some one else's memory
-    uint8_t* line_data = start;
-    capacity = size * 2;
-    start = new uint8_t[capacity];
-    memcpy(start, line_data, size);
-    if (delete_old_buffer) {
-      delete[] line_data;
-    }
+  uint64_t gap_size() const {
+    return capacity > 0 ? capacity - size : 0;
+  }
+  const uint8_t* front() const {
+    return start;
+  }
+  uint64_t front_size() const {
+    return capacity > 0 ? gap : size;
+  }
+  const uint8_t* back() const {
+    return start + front_size() + gap_size();
+  }
+  uint64_t back_size() const {
+    return size - front_size();
+  }
+  uint8_t at(uint64_t i) const {
+    return (i < front_size()) ? start[i] : start[i + gap_size()];
+  }
+  void copy_out(uint8_t* dest, uint64_t from, uint64_t to) const {
+    // copy the text [from, to) to dest, stitching it together across the gap
+    uint64_t split = std::min(std::max(from, front_size()), to);
+    memcpy(dest, front() + from, split - from);
+    memcpy(dest + split - from, back() + split - front_size(), to - split);
+  }
+  std::atomic<uint32_t>& refs() const {
+    return *(std::atomic<uint32_t>*)(start - EDIT_HEADER_SIZE);
+  }
+  bool shared() const {
+    return capacity > 0 && refs() > 1;
+  }
+  static uint8_t* new_edit_buffer(uint64_t& capacity) {
+    capacity += EDIT_HEADER_SIZE;
+    uint8_t* block = EditArena::alloc(capacity);
+    capacity -= EDIT_HEADER_SIZE;
+    new (block) std::atomic<uint32_t>(1);
+    return block + EDIT_HEADER_SIZE;
+  }
+  void alloc_edit_buffer(uint64_t min_gap = 1) {
+    LineMeta old = *this;
+    capacity = std::max(size * 2, size + min_gap);
+    start = new_edit_buffer(capacity);
+    gap = old.front_size();
+    memcpy(start, old.front(), gap);
+    memcpy(start + capacity - old.back_size(), old.back(), old.back_size());
+    old.release();
     beep(); // BEL
   }
-  LineMeta duplicate() {
-    LineMeta retval;
-    retval.size = size;
+  LineMeta share() const {
+    if (capacity > 0) {
+      refs()++;
+    }
+    return *this;
+  }
+  void release() {
+    // drop this line's reference to its edit buffer, if it has one (the
+    // file buffer is never freed)
+    if (capacity > 0 && --refs() == 0) {
+      EditArena::free(start - EDIT_HEADER_SIZE, capacity + EDIT_HEADER_SIZE);
+    }
+    *this = LineMeta();
+  }
+  void make_gap(uint64_t min_gap) {
+    // make sure this line has an edit buffer of its own with room for
+    // min_gap bytes
+    if (capacity == 0 || shared() || gap_size() < min_gap) {
+      alloc_edit_buffer(min_gap);
+    }
+  }
+  void move_gap(uint64_t col) {
+    assert(capacity > 0 && col <= size);
+    uint64_t gap_len = gap_size();
+    if (col < gap) {
+      memmove(start + col + gap_len, start + col, gap - col);
+    } else if (col > gap) {
+      memmove(start + gap, start + gap + gap_len, col - gap);
+    }
+    gap = col;
+  }
+  void truncate(uint64_t col) {
+    // cutting the text short only needs a write if some of what is kept
+    // is behind the gap
+    assert(col <= size);
+    if (capacity > 0 && gap < col) {
+      make_gap(0);
+      move_gap(col);
+    }
+    gap = std::min(gap, col);
+    size = col;
+  }
+  void insert(uint64_t col, const uint8_t* text, uint64_t n) {
+    make_gap(n);
+    move_gap(col);
+    memcpy(start + gap, text, n);
+    gap += n;
+    size += n;
+  }
+  static LineMeta copy_of(const uint8_t* text, uint64_t n) {
+    // a line with its own edit buffer holding text
+    LineMeta retval = {};
+    retval.size = n;
+    retval.capacity = std::max(n, (uint64_t)1);
+    retval.start = new_edit_buffer(retval.capacity);
+    retval.gap = n;
+    memcpy(retval.start, text, n);
+    return retval;
+  }
+  LineMeta slice(uint64_t from, uint64_t to) const {
+    // lines in the file buffer are never written, so a slice of one can
+    // simply point at the same bytes; anything else gets its own copy
+    LineMeta retval = {};
+    retval.size = to - from;
+    if (capacity == 0) {
+      retval.start = start + from;
+      return retval;
+    }
     retval.capacity = retval.size * 2;
-    retval.start = new uint8_t[retval.capacity];
-    memcpy(retval.start, start, size);
+    retval.start = new_edit_buffer(retval.capacity);
+    retval.gap = retval.size;
+    copy_out(retval.start, from, to);
     return retval;
   }
 };
 
-std::vector<LineMeta> file_lines;
-std::vector<LineMeta> cutbuffer;
-bool cut_sequence = false;
+// file_lines used to be a flat vector, so an Enter, cut or paste near the
+// top of a big file moved every LineMeta below it.  LineTree is a B+tree of
+// LineMeta where each inner node keeps the number of lines under each of
+// its children: finding, inserting and erasing a line is O(log n), and
+// inserting or erasing a block of k lines is O(k + log n).
+//
+// operator[] returns a copy; use edit() to change a line in place.  The
+// reference edit() returns is good until the next insert or erase.
+//
+// snapshot() makes a read-only copy in O(1) by sharing the root.  Nodes
+// count the trees holding them, and a change to a shared node copies it
+// (and the path down to it) first.  A leaf holds a reference to each edit
+// buffer in it, so when the tree and a snapshot part ways over a leaf
+// each side has references of its own: edits then copy the buffer rather
+// than write under the snapshot.  It follows that a line must be out of
+// the tree before its buffer is released.
+//
+// A large file's lines can also go in as sparse runs (append_run()): a run
+// is just the stretch of the file buffer its lines are in, and costs a few
+// bytes however many lines it holds.  Reading a run indexes it on the fly;
+// anything that changes it, or materialize(), indexes it for good.
+// sparsify() turns unedited lines back into runs.  A run can go in
+// uncounted, its line count taken on trust from a cache; recount() checks
+// such runs as they are needed and indexes any that are wrong.
+//
+// A LineMeta is 32 bytes, which adds up to more than many files take.
+// Lines the editor hasn't touched go in packed nodes instead (append(),
+// materialize()): a sparse node that also keeps where each of its lines
+// starts as a 32-bit offset from the node's start, with the size following
+// from the next offset, for about five bytes a line.  Reading one is a
+// lookup, and a change unpacks it into a leaf, so only lines near an edit
+// take full LineMetas.
+//
+// Inner nodes also keep the bytes under each child, so byte_offset() and
+// line_at_byte() convert between lines and byte offsets in O(log n).  A
+// line counts as its text and the break after it in the file buffer, or
+// the one '\n' a save writes where there is none.  Rather than chase every
+// change up the tree, whatever changes a child's bytes marks its entry
+// STALE, and the next lookup that needs it adds it up again and keeps it.
+typedef void (*line_indexer_fn)(uint8_t* from, uint8_t* to, uint8_t* end,
+                                uint8_t*& line_start, std::vector<LineMeta>& lines);
+extern line_indexer_fn index_lines;
+uint64_t count_line_breaks(const uint8_t* from, const uint8_t* to);
 
-FILE* file = nullptr;
-std::string filePath;
-uint8_t* fileBuffer = nullptr;
-bool dirty = false;
+class LineTree {
+  static const int LEAF_MAX = 256;
+  static const int INNER_MAX = 64;
 
-int first_line = 0;
-int left_margin = 0;
-int cx = 0, cy = 0;
-int preferred_cx = 0;
+  struct Node {
+    bool leaf;    // a leaf or a sparse run
+    bool sparse;
+    bool packed;  // a sparse run with its lines' offsets
+    int n;  // lines in a leaf or run, children in an inner node
+    int refs;  // trees and parent nodes holding this one
+  };
+  struct Leaf : Node {
+    LineMeta lines[LEAF_MAX];
+    uint8_t lex[LEAF_MAX];  // highlighter state at the end of each line
+  };
+  struct Sparse : Node {
+    uint8_t* start;  // the lines that indexing [start, end) gives
+    uint8_t* end;
+    bool counted;    // n is known to be right
+  };
+  struct Packed : Sparse {
+    uint32_t offset[LEAF_MAX + 1];  // of each line and of the end, from start
+    uint64_t crlf[LEAF_MAX / 64];   // lines that end in "\r\n" rather than one byte
+    uint8_t lex[LEAF_MAX];
+  };
+  struct Inner : Node {
+    Node* child[INNER_MAX];
+    uint64_t count[INNER_MAX];  // lines under each child
+    uint64_t bytes[INNER_MAX];  // likewise bytes, or STALE
+  };
 
-time_t cl_message_time = 0;
-std::string cl_message;
-int cl_message_level = 0;
+  Node* root;
+  uint64_t total;
+  bool read_only;  // a snapshot
+  bool uncounted;  // runs have gone in uncounted
 
-enum {
-  COLOR_PAIR_LINENUM = 1,
-  COLOR_PAIR_LINENUM_SHADED,
-  COLOR_PAIR_LINE_SHADED,
-  COLOR_PAIR_ERROR,
-  COLOR_PINK = 101,
-  COLOR_LINE_SHADE,
-};
+  static std::mutex miscounted_mutex;
+  static std::vector<const uint8_t*> miscounted_runs;  // starts of runs reads found wrong
 
-#define CTRL(x) ((x) & 0x1f)
+  LineTree(Node* root, uint64_t total) : root(root), total(total), read_only(true), uncounted(false) {
+  }
 
-void handle_sigwinch(int signal) {
-  window_resized = true;
-}
+public:
+  static const uint8_t LEX_UNKNOWN = 0xff;  // the line hasn't been lexed
+  static const int RUN_MAX = LEAF_MAX * INNER_MAX;  // lines in a sparse run
+  static std::atomic<uint64_t> live_leaves;  // in every tree
+  static std::atomic<uint64_t> live_packed;  // likewise
 
-void handle_sigcont(int signal) {
-  window_resized = true;
-}
+  struct Recount {
+    uint64_t line;  // where a miscounted run starts
+    uint64_t was;   // the lines it was taken to hold
+    uint64_t now;   // and the lines it holds
+  };
 
-void do_putc(char c, unsigned int line, unsigned int col) {
-  assert(line < file_lines.size());
-  LineMeta& line_meta = file_lines[line];
-  assert(col <= line_meta.size);
-  if (line_meta.size >= line_meta.capacity) {
-    line_meta.alloc_edit_buffer();
+  static uint64_t index_bytes() {
+    // what the leaves and packed nodes of every tree take
+    return live_leaves * sizeof(Leaf) + live_packed * sizeof(Packed);
+  }
+
+  class iterator {
+    friend class LineTree;
+    const LineTree* tree;
+    uint64_t index;
+    Node* node;
+    uint64_t pos;
+    std::vector<LineMeta> run;  // a sparse node's lines, indexed on the way
+
+    void enter() {
+      if (node && node->sparse) {
+        run.clear();
+        sparse_lines((Sparse*)node, run);
+      }
+    }
+  public:
+    const LineMeta& operator*() const {
+      return node->sparse ? run[pos] : ((Leaf*)node)->lines[pos];
+    }
+    const LineMeta* operator->() const {
+      return &**this;
+    }
+    iterator& operator++() {
+      index++;
+      pos++;
+      if (index < tree->total && pos >= (uint64_t)node->n) {
+        pos = index;
+        node = tree->find(pos);
+        enter();
+      }
+      return *this;
+    }
+    bool operator!=(const iterator& other) const {
+      return index != other.index;
+    }
+    uint64_t line() const {
+      return index;
+    }
+    const uint8_t* scanned_from() const {
+      // how far back in the file buffer getting here read: a sparse run
+      // is indexed from its start
+      return node->sparse ? ((Sparse*)node)->start : (**this).start;
+    }
+  };
+
+  LineTree() : root(new_leaf()), total(0), read_only(false), uncounted(false) {
   }
-  uint8_t* cp = line_meta.start + col;
-  while (cp < line_meta.start + line_meta.size + 1) {
-    char last_c = *cp;
-    *cp++ = c;
-    c = last_c;
+  ~LineTree() {
+    if (read_only) {
+      release_node(root);
+    } else {
+      free_node(root);
+    }
   }
-  line_meta.size++;
-  dirty = true;
-}
+  LineTree(const LineTree&) = delete;
+  LineTree& operator=(const LineTree&) = delete;
 
-void pad(unsigned int line, unsigned int col) {
-  assert(line < file_lines.size());
-  LineMeta& line_meta = file_lines[line];
-  while (col >= line_meta.size) {
-    do_putc(' ', line, line_meta.size);
+  uint64_t size() const {
+    return total;
   }
-  assert(line_meta.size >= col);
-}
 
-void putc(char c, unsigned int line, unsigned int col) {
-  pad(line, col);
-  do_putc(c, line, col);
-}
+  LineMeta operator[](uint64_t i) const {
+    assert(i < total);
+    Node* node = find(i);
+    if (node->packed) {
+      return packed_line((Packed*)node, i);
+    }
+    if (node->sparse) {
+      std::vector<LineMeta> run;
+      sparse_lines((Sparse*)node, run);
+      return run[i];
+    }
+    return ((Leaf*)node)->lines[i];
+  }
 
-void removec(unsigned int line, unsigned int col) {
-  assert(line < file_lines.size());
-  LineMeta& line_meta = file_lines[line];
-  pad(line, col);
-  assert(col < line_meta.size);
-  if (line_meta.size >= line_meta.capacity) {
-    line_meta.alloc_edit_buffer();
+  LineMeta& edit(uint64_t i) {
+    assert(i < total && !read_only);
+    Leaf* leaf = (Leaf*)edit_node(i, false, true);
+    return leaf->lines[i];
   }
-  uint8_t* cp = line_meta.start + col;
-  while (cp < line_meta.start + line_meta.size) {
-    *cp = *(cp + 1);
-    cp++;
+
+  uint64_t byte_offset(uint64_t i, const uint8_t* end) {
+    // where line i starts; end is the end of the file buffer
+    assert(i < total && !read_only);
+    materialize(i, i + 1);
+    uint64_t offset = 0;
+    Node* node = root;
+    while (!node->leaf) {
+      Inner* inner = (Inner*)node;
+      int c = 0;
+      for (; i >= inner->count[c]; c++) {
+        i -= inner->count[c];
+        offset += child_bytes(inner, c, end);
+      }
+      node = inner->child[c];
+    }
+    if (node->packed) {
+      return offset + ((Packed*)node)->offset[i];
+    }
+    Leaf* leaf = (Leaf*)node;
+    for (uint64_t m = 0; m < i; m++) {
+      offset += line_bytes(leaf->lines[m], end);
+    }
+    return offset;
   }
-  line_meta.size--;
-  dirty = true;
-}
 
-void putnl(unsigned int line, unsigned int col) {
-  assert(line < file_lines.size());
-  LineMeta& first_line = file_lines[line];
-  pad(line, col);
+  uint64_t line_at_byte(uint64_t& offset, const uint8_t* end) {
+    // the line byte offset falls in, leaving offset as the column; an
+    // offset past the end lands in the last line
+    assert(total > 0 && !read_only);
+    uint64_t wanted = offset;
+    uint64_t line = 0;
+    Node* node = root;
+    while (!node->leaf) {
+      Inner* inner = (Inner*)node;
+      int c = 0;
+      for (; c < inner->n - 1; c++) {
+        uint64_t bytes = child_bytes(inner, c, end);
+        if (offset < bytes) {
+          break;
+        }
+        offset -= bytes;
+        line += inner->count[c];
+      }
+      node = inner->child[c];
+    }
+    if (node->packed) {
+      Packed* packed = (Packed*)node;
+      uint64_t m = std::upper_bound(packed->offset, packed->offset + packed->n, offset) - packed->offset - 1;
+      offset -= packed->offset[m];
+      return line + m;
+    }
+    if (node->sparse) {
+      materialize(line, line + 1);
+      offset = wanted;
+      return line_at_byte(offset, end);
+    }
+    Leaf* leaf = (Leaf*)node;
+    int m = 0;
+    for (; m < leaf->n - 1 && offset >= line_bytes(leaf->lines[m], end); m++) {
+      offset -= line_bytes(leaf->lines[m], end);
+    }
+    return line + m;
+  }
 
-  LineMeta second_line = {0};
-  second_line.start = first_line.start + col;
-  second_line.size = first_line.size - col;
-  if (second_line.size >= second_line.capacity) {
-    second_line.alloc_edit_buffer();
+  uint64_t byte_count(const uint8_t* end) {
+    // the bytes in all the lines, with no break after the last
+    assert(!read_only);
+    return total > 0 ? node_bytes(root, end) - 1 : 0;
   }
 
-  first_line.size = col;
+  uint8_t lex_state(uint64_t i) const {
+    assert(i < total);
+    Node* node = find(i);
+    if (node->packed) {
+      return ((Packed*)node)->lex[i];
+    }
+    return node->sparse ? LEX_UNKNOWN : ((Leaf*)node)->lex[i];
+  }
 
-  auto iter = file_lines.begin() + line + 1;
-  file_lines.insert(iter, second_line);
-  dirty = true;
-}
+  void set_lex_state(uint64_t i, uint8_t state) {
+    // a packed line keeps its state without being unpacked
+    assert(i < total && !read_only);
+    if (lex_state(i) == state) {
+      return;
+    }
+    Node* node = edit_node(i, true);
+    if (node->packed) {
+      ((Packed*)node)->lex[i] = state;
+    } else {
+      ((Leaf*)node)->lex[i] = state;
+    }
+  }
 
-void combine_lines(unsigned int line1, unsigned int line2) {
-  assert(line1 < file_lines.size());
-  assert(line2 < file_lines.size());
-  // this is probably not strictly required, but we probably don't
-  // want to combine in the wrong order
-  assert(line1 < line2);
+  LineTree* snapshot() const {
+    assert(!read_only);
+    root->refs++;
+    return new LineTree(root, total);
+  }
 
-  LineMeta& first_line = file_lines[line1];
-  LineMeta& second_line = file_lines[line2];
+  iterator begin(uint64_t from = 0) const {
+    iterator it;
+    it.tree = this;
+    it.index = std::min(from, total);
+    it.pos = it.index;
+    it.node = (it.index < total) ? find(it.pos) : nullptr;
+    it.enter();
+    return it;
+  }
+  iterator end() const {
+    return begin(total);
+  }
 
-  LineMeta new_line = {0};
-  new_line.size = first_line.size + second_line.size;
-  new_line.capacity = new_line.size * 2;
-  new_line.start = new uint8_t[new_line.capacity];
-  memcpy(new_line.start,                   first_line.start, first_line.size);
-  memcpy(new_line.start + first_line.size, second_line.start, second_line.size);
+  void insert(uint64_t pos, const LineMeta& line) {
+    insert(pos, &line, &line + 1);
+  }
 
-  // be careful not to delete someone else's memory
-  if (first_line.capacity > 0) {
-    delete[] first_line.start;
+  void insert(uint64_t pos, const LineMeta* first, const LineMeta* last) {
+    assert(pos <= total && !read_only);
+    if (first == last) {
+      return;
+    }
+    std::vector<Node*> split;
+    insert_at(own(root), pos, first, last, split);
+    total += last - first;
+    grow_root(split);
   }
-  if (second_line.capacity > 0) {
-    delete[] second_line.start;
+
+  void append(const LineMeta* first, const LineMeta* last, const uint8_t* end) {
+    // add lines at the end, packed where they are unedited and one stretch
+    // of a buffer that ends at end
+    assert(!read_only);
+    while (first < last) {
+      uint64_t n = std::min((uint64_t)LEAF_MAX, (uint64_t)(last - first));
+      append_node(new_node(first, n, end));
+      first += n;
+    }
   }
 
-  file_lines[line1] = new_line;
+  void append_run(uint8_t* start, uint8_t* end, uint64_t n, bool counted = true) {
+    // add the n lines that indexing [start, end) gives at the end, as a
+    // sparse run
+    assert(!read_only && n > 0 && n <= (uint64_t)RUN_MAX);
+    append_node(new_run(start, end, n, counted));
+    uncounted = uncounted || !counted;
+  }
 
-  auto iter = file_lines.begin() + line2;
-  file_lines.erase(iter);
-  dirty = true;
-}
+  void push_back(const LineMeta& line) {
+    insert(total, line);
+  }
 
-void cut_line(unsigned int line) {
-  assert(line < file_lines.size());
-  cutbuffer.push_back(file_lines[line]);
-  auto iter = file_lines.begin() + line;
-  file_lines.erase(iter);
-  dirty = true;
-}
+  void erase(uint64_t pos, uint64_t n = 1) {
+    assert(pos + n <= total && !read_only);
+    if (n == 0) {
+      return;
+    }
+    erase_at(own(root), pos, n);
+    total -= n;
+    while (!root->leaf && root->n == 1) {
+      Inner* old_root = (Inner*)root;
+      root = old_root->child[0];
+      delete old_root;
+    }
+    if (!root->leaf && root->n == 0) {
+      delete (Inner*)root;
+      root = new_leaf();
+    }
+  }
 
-void clear_cutbuffer() {
-  for (LineMeta& line_meta : cutbuffer) {
-    // be careful not to delete someone else's memory
-    if (line_meta.capacity > 0) {
-      delete[] line_meta.start;
+  void clear() {
+    assert(!read_only);
+    free_node(root);
+    root = new_leaf();
+    total = 0;
+  }
+
+  void materialize(uint64_t from, uint64_t to) {
+    // index any sparse runs among lines [from, to) into packed nodes
+    assert(!read_only);
+    for (uint64_t i = from; i < std::min(to, total);) {
+      uint64_t j = i;
+      Node* node = find(j);
+      if (node->sparse && !node->packed) {
+        j = i;
+        node = edit_node(j, true);
+      }
+      i += node->n - j;
     }
   }
-  cutbuffer.clear();
-}
 
-void insert_cutbuffer(unsigned int line) {
-  assert(line < file_lines.size());
-  auto iter = file_lines.begin() + line;
-  file_lines.insert(iter, cutbuffer.begin(), cutbuffer.end());
-  dirty = true;
-}
+  bool recount(uint64_t from, uint64_t to, std::vector<Recount>& fixed) {
+    // check the uncounted runs among lines [from, to), and any that a read
+    // has found wrong wherever they are.  A wrong one is indexed into the
+    // lines it really holds and listed in fixed, each at its line once the
+    // ones before it are put right; true if there were any
+    assert(!read_only);
+    if (!uncounted) {
+      return false;
+    }
+    std::vector<const uint8_t*> flagged;
+    {
+      std::lock_guard<std::mutex> lock(miscounted_mutex);
+      flagged.swap(miscounted_runs);
+    }
+    if (!recount_at(root, 0, from, to, flagged, false, fixed)) {
+      return false;
+    }
+    if (!root->sparse) {
+      own(root);
+    }
+    recount_at(root, 0, from, to, flagged, true, fixed);
+    total = node_count(root);
+    return true;
+  }
 
-void duplicate_line(unsigned int line) {
-  assert(line < file_lines.size());
-  LineMeta& first_line = file_lines[line];
-  
-  LineMeta second_line = {0};
-  second_line.size = first_line.size;
-  second_line.capacity = second_line.size * 2;
-  second_line.start = new uint8_t[second_line.capacity];
-  memcpy(second_line.start, first_line.start, first_line.size);
-  
-  auto iter = file_lines.begin() + line + 1;
-  file_lines.insert(iter, second_line);
-  dirty = true;
-}
+  void sparsify(uint64_t keep_from, uint64_t keep_to, const uint8_t* begin, const uint8_t* end) {
+    // turn leaves outside lines [keep_from, keep_to) back into sparse runs
+    // where their lines are unedited and still one stretch of [begin, end)
+    assert(!read_only);
+    if (!root->leaf && root->refs == 1) {
+      sparsify_at((Inner*)root, 0, keep_from, keep_to, begin, end);
+    }
+  }
 
-void display_file() {
-  int last_line = LINES - 2 + first_line;
-  int line_num_length = 0;
-  for (int k = last_line - 1; k > 0; k /= 10) {
-    line_num_length++;
+private:
+  static const uint64_t STALE = UINT64_MAX;
+
+  static Leaf* new_leaf() {
+    Leaf* leaf = new Leaf;
+    leaf->leaf = true;
+    leaf->sparse = false;
+    leaf->packed = false;
+    leaf->n = 0;
+    leaf->refs = 1;
+    live_leaves++;
+    return leaf;
   }
-  left_margin = line_num_length + 1;
 
-  // clear text canvas
-  for (int y = 0; y < LINES - 1; y++) {
-    move(y, 0);
-    clrtoeol();
+  static Inner* new_inner() {
+    Inner* inner = new Inner;
+    inner->leaf = false;
+    inner->sparse = false;
+    inner->packed = false;
+    inner->n = 0;
+    inner->refs = 1;
+    return inner;
   }
 
-  // file contents
-  int rows = std::min((uint64_t)LINES - 2, file_lines.size() - first_line);
-  int cols = COLS - left_margin;
+  static Sparse* new_run(uint8_t* start, uint8_t* end, uint64_t n, bool counted = true) {
+    Sparse* run = new Sparse;
+    run->leaf = true;
+    run->sparse = true;
+    run->packed = false;
+    run->n = n;
+    run->refs = 1;
+    run->start = start;
+    run->end = end;
+    run->counted = counted;
+    return run;
+  }
 
-  for (int i = 0; i < rows; i++) {
-    int line_num = first_line + i;
+  static void delete_sparse(Node* node) {
+    if (node->packed) {
+      delete (Packed*)node;
+      live_packed--;
+    } else {
+      delete (Sparse*)node;
+    }
+  }
 
-    move(i, 0);
-    int color_pair = COLOR_PAIR_LINENUM;
-    if (line_num == cy) {
-      color_pair = COLOR_PAIR_LINENUM_SHADED;
+  static uint64_t line_break_size(const LineMeta& line, const uint8_t* end) {
+    // of the break after an unedited line that ends before end, or 0
+    const uint8_t* p = line.start + line.size;
+    if (line.has_edit_buffer() || p >= end) {
+      return 0;
+    }
+    if (*p == '\r') {
+      return (p + 1 < end && p[1] == '\n') ? 2 : 1;
+    }
+    return (*p == '\n') ? 1 : 0;
+  }
+
+  static uint64_t line_bytes(const LineMeta& line, const uint8_t* end) {
+    return line.size + std::max(line_break_size(line, end), (uint64_t)1);
+  }
+
+  static uint64_t node_bytes(Node* node, const uint8_t* end) {
+    if (node->sparse) {
+      return ((Sparse*)node)->end - ((Sparse*)node)->start;
+    }
+    uint64_t bytes = 0;
+    if (node->leaf) {
+      Leaf* leaf = (Leaf*)node;
+      for (int m = 0; m < leaf->n; m++) {
+        bytes += line_bytes(leaf->lines[m], end);
+      }
+      return bytes;
+    }
+    Inner* inner = (Inner*)node;
+    for (int c = 0; c < inner->n; c++) {
+      bytes += child_bytes(inner, c, end);
+    }
+    return bytes;
+  }
+
+  static uint64_t child_bytes(Inner* inner, int c, const uint8_t* end) {
+    if (inner->bytes[c] == STALE) {
+      inner->bytes[c] = node_bytes(inner->child[c], end);
+    }
+    return inner->bytes[c];
+  }
+
+  static Packed* pack(const LineMeta* lines, uint64_t n, const uint8_t* end) {
+    // n lines in a packed node, if they are unedited, one after the other
+    // and each with a break after it before end
+    assert(n > 0 && n <= (uint64_t)LEAF_MAX);
+    uint8_t* start = lines[0].start;
+    uint8_t* next = start;
+    uint32_t offset[LEAF_MAX + 1];
+    uint64_t crlf[LEAF_MAX / 64] = {0};
+    for (uint64_t m = 0; m < n; m++) {
+      uint64_t size = line_break_size(lines[m], end);
+      if (size == 0 || lines[m].start != next ||
+          (uint64_t)(next + lines[m].size + size - start) > UINT32_MAX) {
+        return nullptr;
+      }
+      offset[m] = next - start;
+      crlf[m / 64] |= (uint64_t)(size == 2) << (m % 64);
+      next += lines[m].size + size;
+    }
+    offset[n] = next - start;
+    Packed* packed = new Packed;
+    packed->leaf = true;
+    packed->sparse = true;
+    packed->packed = true;
+    packed->n = n;
+    packed->refs = 1;
+    packed->start = start;
+    packed->end = next;
+    packed->counted = true;
+    std::copy(offset, offset + n + 1, packed->offset);
+    std::copy(crlf, crlf + LEAF_MAX / 64, packed->crlf);
+    memset(packed->lex, LEX_UNKNOWN, n);
+    live_packed++;
+    return packed;
+  }
+
+  static LineMeta packed_line(const Packed* packed, uint64_t m) {
+    LineMeta line = {};
+    line.start = packed->start + packed->offset[m];
+    line.size = packed->offset[m + 1] - packed->offset[m] - 1 - ((packed->crlf[m / 64] >> (m % 64)) & 1);
+    return line;
+  }
+
+  static Node* new_node(const LineMeta* lines, uint64_t n, const uint8_t* end) {
+    // n lines packed if they can be, or else in a leaf
+    Node* node = pack(lines, n, end);
+    if (!node) {
+      Leaf* leaf = new_leaf();
+      leaf->n = n;
+      std::copy(lines, lines + n, leaf->lines);
+      memset(leaf->lex, LEX_UNKNOWN, n);
+      node = leaf;
+    }
+    return node;
+  }
+
+  static Leaf* unpack(const Packed* packed) {
+    Leaf* leaf = new_leaf();
+    leaf->n = packed->n;
+    for (int m = 0; m < packed->n; m++) {
+      leaf->lines[m] = packed_line(packed, m);
+    }
+    std::copy(packed->lex, packed->lex + packed->n, leaf->lex);
+    return leaf;
+  }
+
+  void append_node(Node* node) {
+    // add a leaf, run or packed node after the last line
+    std::vector<Node*> split;
+    if (root->leaf && !root->sparse && root->n == 0) {
+      delete (Leaf*)root;
+      live_leaves--;
+      root = node;
+    } else if (root->leaf) {
+      split.push_back(node);  // a new root goes over both
+    } else {
+      append_at((Inner*)own(root), node, split);
+    }
+    total += node->n;
+    grow_root(split);
+  }
+
+  void grow_root(std::vector<Node*>& split) {
+    // grow new roots over the old one until everything fits under one node
+    while (split.size()) {
+      split.insert(split.begin(), root);
+      root = new_inner();
+      std::vector<Node*> rest;
+      inner_fill((Inner*)root, split, rest);
+      split.swap(rest);
+    }
+  }
+
+  static void sparse_lines(const Sparse* run, std::vector<LineMeta>& lines) {
+    uint64_t before = lines.size();
+    lines.reserve(before + run->n);
+    if (run->packed) {
+      for (int m = 0; m < run->n; m++) {
+        lines.push_back(packed_line((const Packed*)run, m));
+      }
+      return;
+    }
+    uint8_t* line_start = run->start;
+    index_lines(run->start, run->end, run->end, line_start, lines);
+    uint64_t n = lines.size() - before;
+    if (n != (uint64_t)run->n) {
+      // an uncounted run that was wrong.  Until recount() puts it right,
+      // make do with run->n lines that still cover all of its bytes: the
+      // last takes in any over, and empty ones make up any short
+      {
+        std::lock_guard<std::mutex> lock(miscounted_mutex);
+        miscounted_runs.push_back(run->start);
+      }
+      if (n > (uint64_t)run->n) {
+        LineMeta& last = lines[before + run->n - 1];
+        last.size = lines.back().start + lines.back().size - last.start;
+        lines.resize(before + run->n);
+      } else {
+        LineMeta empty = {};
+        empty.start = run->end;
+        lines.resize(before + run->n, empty);
+      }
+    }
+  }
+
+  static Node* materialize(const Sparse* run) {
+    // index a run into packed nodes
+    std::vector<LineMeta> lines;
+    sparse_lines(run, lines);
+    return pack_lines(lines, run->end);
+  }
+
+  static Node* pack_lines(std::vector<LineMeta>& lines, const uint8_t* end) {
+    // lines in packed nodes where they can be, under inner nodes if they
+    // take more than one
+    uint64_t n = lines.size();
+    uint64_t pieces = (n + LEAF_MAX - 1) / LEAF_MAX;
+    std::vector<Node*> nodes;
+    for (uint64_t p = 0, j = 0; p < pieces; p++) {
+      uint64_t share = n / pieces + (p < n % pieces);
+      nodes.push_back(new_node(&lines[j], share, end));
+      j += share;
+    }
+    while (nodes.size() > 1) {
+      std::vector<Node*> rest;
+      Inner* inner = new_inner();
+      inner_fill(inner, nodes, rest);
+      rest.insert(rest.begin(), inner);
+      nodes.swap(rest);
+    }
+    return nodes[0];
+  }
+
+  static bool recount_at(Node*& node, uint64_t offset, uint64_t from, uint64_t to,
+                         const std::vector<const uint8_t*>& flagged, bool fix,
+                         std::vector<Recount>& fixed) {
+    // recount() under node, whose first line is line offset: whether a run
+    // under it is wrong, and with fix, putting them right
+    if (node->sparse) {
+      Sparse* run = (Sparse*)node;
+      bool wanted = (offset < to && offset + run->n > from) ||
+                    std::find(flagged.begin(), flagged.end(), run->start) != flagged.end();
+      if (run->packed || run->counted || !wanted) {
+        return false;
+      }
+      if (count_line_breaks(run->start, run->end) == (uint64_t)run->n) {
+        run->counted = true;
+        return false;
+      }
+      if (!fix) {
+        return true;
+      }
+      std::vector<LineMeta> lines;
+      uint8_t* line_start = run->start;
+      index_lines(run->start, run->end, run->end, line_start, lines);
+      Recount recount = { offset, (uint64_t)run->n, lines.size() };
+      fixed.push_back(recount);
+      Node* now = pack_lines(lines, run->end);
+      if (--node->refs == 0) {
+        delete_sparse(node);
+      }
+      node = now;
+      return true;
+    }
+    if (node->leaf) {
+      return false;
+    }
+    Inner* inner = (Inner*)node;
+    bool found = false;
+    for (int c = 0; c < inner->n; offset += inner->count[c], c++) {
+      if (flagged.empty() && (offset >= to || offset + inner->count[c] <= from)) {
+        continue;
+      }
+      if (!recount_at(inner->child[c], offset, from, to, flagged, false, fixed)) {
+        continue;
+      }
+      found = true;
+      if (!fix) {
+        return true;
+      }
+      if (!inner->child[c]->sparse) {
+        own(inner->child[c]);
+      }
+      recount_at(inner->child[c], offset, from, to, flagged, true, fixed);
+      inner->count[c] = node_count(inner->child[c]);
+    }
+    return found;
+  }
+
+  static Node* own(Node*& node) {
+    // make node safe to change, copying it if a snapshot shares it; a
+    // sparse run is indexed into leaves instead, and a packed node unpacked
+    if (node->sparse) {
+      Node* lines = node->packed ? unpack((Packed*)node) : materialize((Sparse*)node);
+      if (--node->refs == 0) {
+        delete_sparse(node);
+      }
+      node = lines;
+      return own(node);  // a run can come out as one packed node
+    }
+    if (node->refs > 1) {
+      node->refs--;
+      if (node->leaf) {
+        Leaf* copy = new Leaf(*(Leaf*)node);
+        live_leaves++;
+        for (int m = 0; m < copy->n; m++) {
+          copy->lines[m].share();
+        }
+        node = copy;
+      } else {
+        Inner* copy = new Inner(*(Inner*)node);
+        for (int c = 0; c < copy->n; c++) {
+          copy->child[c]->refs++;
+        }
+        node = copy;
+      }
+      node->refs = 1;
+    }
+    return node;
+  }
+
+  static Node* own_packed(Node*& node) {
+    // like own(), but a packed node stays packed, and a sparse run is
+    // indexed into packed nodes
+    if (node->sparse && !node->packed) {
+      Node* lines = materialize((Sparse*)node);
+      if (--node->refs == 0) {
+        delete_sparse(node);
+      }
+      node = lines;
+    } else if (node->packed && node->refs > 1) {
+      node->refs--;
+      node = new Packed(*(Packed*)node);
+      node->refs = 1;
+      live_packed++;
+    } else if (!node->packed) {
+      own(node);
+    }
+    return node;
+  }
+
+  static void share_lines(Node* node) {
+    if (node->sparse) {
+      return;  // nothing in a run has an edit buffer
+    }
+    if (node->leaf) {
+      Leaf* leaf = (Leaf*)node;
+      for (int m = 0; m < leaf->n; m++) {
+        leaf->lines[m].share();
+      }
+      return;
+    }
+    Inner* inner = (Inner*)node;
+    for (int c = 0; c < inner->n; c++) {
+      share_lines(inner->child[c]);
+    }
+  }
+
+  static void release_node(Node* node) {
+    // a snapshot lets go of node; whoever lets go last drops the node's
+    // references to its lines
+    if (--node->refs > 0) {
+      return;
+    }
+    if (node->sparse) {
+      delete_sparse(node);
+      return;
+    }
+    if (node->leaf) {
+      Leaf* leaf = (Leaf*)node;
+      for (int m = 0; m < leaf->n; m++) {
+        leaf->lines[m].release();
+      }
+      delete leaf;
+      live_leaves--;
+      return;
+    }
+    Inner* inner = (Inner*)node;
+    for (int c = 0; c < inner->n; c++) {
+      release_node(inner->child[c]);
+    }
+    delete inner;
+  }
+
+  static void free_node(Node* node) {
+    // the tree lets go of node, and the lines in it now belong to whoever
+    // took them out
+    if (node->refs > 1) {
+      // a snapshot still has them and needs references of its own
+      node->refs--;
+      share_lines(node);
+      return;
+    }
+    if (node->sparse) {
+      delete_sparse(node);
+      return;
+    }
+    if (node->leaf) {
+      delete (Leaf*)node;
+      live_leaves--;
+      return;
+    }
+    Inner* inner = (Inner*)node;
+    for (int c = 0; c < inner->n; c++) {
+      free_node(inner->child[c]);
+    }
+    delete inner;
+  }
+
+  static uint64_t node_count(Node* node) {
+    if (node->leaf) {
+      return node->n;
+    }
+    Inner* inner = (Inner*)node;
+    uint64_t count = 0;
+    for (int c = 0; c < inner->n; c++) {
+      count += inner->count[c];
+    }
+    return count;
+  }
+
+  Node* find(uint64_t& i) const {
+    // on return i is the index within the leaf or run
+    Node* node = root;
+    while (!node->leaf) {
+      Inner* inner = (Inner*)node;
+      int c = 0;
+      while (i >= inner->count[c]) {
+        i -= inner->count[c];
+        c++;
+      }
+      node = inner->child[c];
+    }
+    return node;
+  }
+
+  Node* edit_node(uint64_t& i, bool keep_packed, bool resized = false) {
+    // like find(), but anything on the way down that a snapshot shares is
+    // copied first, and what is at the bottom is a leaf unless keep_packed
+    // lets it be a packed node.  If the line's size is to change, the byte
+    // counts on the way go stale.
+    Node* node = keep_packed ? own_packed(root) : own(root);
+    while (!node->leaf) {
+      Inner* inner = (Inner*)node;
+      int c = 0;
+      while (i >= inner->count[c]) {
+        i -= inner->count[c];
+        c++;
+      }
+      if (resized) {
+        inner->bytes[c] = STALE;
+      }
+      node = keep_packed ? own_packed(inner->child[c]) : own(inner->child[c]);
+    }
+    return node;
+  }
+
+  static void inner_fill(Inner* node, const std::vector<Node*>& children,
+                         std::vector<Node*>& split) {
+    // share `children` evenly between `node` and as few new inner nodes as
+    // needed, which are appended to `split`
+    uint64_t pieces = (children.size() + INNER_MAX - 1) / INNER_MAX;
+    uint64_t k = 0;
+    for (uint64_t p = 0; p < pieces; p++) {
+      Inner* inner = node;
+      if (p > 0) {
+        inner = new_inner();
+        split.push_back(inner);
+      }
+      uint64_t share = children.size() / pieces + (p < children.size() % pieces);
+      inner->n = share;
+      for (uint64_t c = 0; c < share; c++, k++) {
+        inner->child[c] = children[k];
+        inner->count[c] = node_count(children[k]);
+        inner->bytes[c] = STALE;
+      }
+    }
+  }
+
+  static void insert_at(Node* node, uint64_t i, const LineMeta* first,
+                        const LineMeta* last, std::vector<Node*>& split) {
+    uint64_t k = last - first;
+    if (node->leaf) {
+      Leaf* leaf = (Leaf*)node;
+      if (leaf->n + k <= LEAF_MAX) {
+        memmove(&leaf->lines[i + k], &leaf->lines[i], (leaf->n - i) * sizeof(LineMeta));
+        memmove(&leaf->lex[i + k], &leaf->lex[i], leaf->n - i);
+        std::copy(first, last, &leaf->lines[i]);
+        memset(&leaf->lex[i], LEX_UNKNOWN, k);
+        leaf->n += k;
+        return;
+      }
+      // lay the old lines with the new ones spliced in over as many leaves
+      // as it takes, this one first
+      Leaf old = *leaf;
+      uint64_t n = old.n + k;
+      uint64_t pieces = (n + LEAF_MAX - 1) / LEAF_MAX;
+      uint64_t j = 0;
+      for (uint64_t p = 0; p < pieces; p++) {
+        Leaf* out = leaf;
+        if (p > 0) {
+          out = new_leaf();
+          split.push_back(out);
+        }
+        out->n = n / pieces + (p < n % pieces);
+        for (int m = 0; m < out->n; m++, j++) {
+          if (j < i) {
+            out->lines[m] = old.lines[j];
+            out->lex[m] = old.lex[j];
+          } else if (j < i + k) {
+            out->lines[m] = first[j - i];
+            out->lex[m] = LEX_UNKNOWN;
+          } else {
+            out->lines[m] = old.lines[j - k];
+            out->lex[m] = old.lex[j - k];
+          }
+        }
+      }
+      return;
+    }
+
+    Inner* inner = (Inner*)node;
+    int c = 0;
+    while (c < inner->n - 1 && i > inner->count[c]) {
+      i -= inner->count[c];
+      c++;
+    }
+    std::vector<Node*> child_split;
+    insert_at(own(inner->child[c]), i, first, last, child_split);
+    inner->bytes[c] = STALE;
+    if (child_split.empty()) {
+      inner->count[c] += k;
+      return;
+    }
+    inner->count[c] = node_count(inner->child[c]);
+    inner_add(inner, c, child_split, split);
+  }
+
+  static void append_at(Inner* inner, Node* node, std::vector<Node*>& split) {
+    // add node after the last child of the last inner node down the right
+    int c = inner->n - 1;
+    std::vector<Node*> child_split;
+    if (inner->child[c]->leaf) {
+      child_split.push_back(node);
+    } else {
+      append_at((Inner*)own(inner->child[c]), node, child_split);
+      inner->count[c] = node_count(inner->child[c]);
+      inner->bytes[c] = STALE;
+    }
+    inner_add(inner, c, child_split, split);
+  }
+
+  static void inner_add(Inner* inner, int c, const std::vector<Node*>& child_split,
+                        std::vector<Node*>& split) {
+    // put the nodes child c split off after it
+    if (child_split.empty()) {
+      return;
+    }
+    if (inner->n + child_split.size() <= INNER_MAX) {
+      int m = child_split.size();
+      memmove(&inner->child[c + 1 + m], &inner->child[c + 1], (inner->n - c - 1) * sizeof(Node*));
+      memmove(&inner->count[c + 1 + m], &inner->count[c + 1], (inner->n - c - 1) * sizeof(uint64_t));
+      memmove(&inner->bytes[c + 1 + m], &inner->bytes[c + 1], (inner->n - c - 1) * sizeof(uint64_t));
+      for (int s = 0; s < m; s++) {
+        inner->child[c + 1 + s] = child_split[s];
+        inner->count[c + 1 + s] = node_count(child_split[s]);
+        inner->bytes[c + 1 + s] = STALE;
+      }
+      inner->n += m;
+      return;
+    }
+    std::vector<Node*> children(inner->child, inner->child + c + 1);
+    children.insert(children.end(), child_split.begin(), child_split.end());
+    children.insert(children.end(), inner->child + c + 1, inner->child + inner->n);
+    inner_fill(inner, children, split);
+  }
+
+  static void erase_at(Node* node, uint64_t i, uint64_t k) {
+    if (node->leaf) {
+      Leaf* leaf = (Leaf*)node;
+      memmove(&leaf->lines[i], &leaf->lines[i + k], (leaf->n - i - k) * sizeof(LineMeta));
+      memmove(&leaf->lex[i], &leaf->lex[i + k], leaf->n - i - k);
+      leaf->n -= k;
+      return;
+    }
+
+    Inner* inner = (Inner*)node;
+    int kept = 0;
+    int touched[2];
+    int n_touched = 0;
+    uint64_t offset = 0;
+    for (int c = 0; c < inner->n; c++) {
+      Node* child = inner->child[c];
+      uint64_t count = inner->count[c];
+      uint64_t bytes = inner->bytes[c];
+      uint64_t child_offset = offset;
+      offset += count;
+      uint64_t from = std::max(child_offset, i);
+      uint64_t to = std::min(child_offset + count, i + k);
+      if (from < to && to - from == count) {
+        free_node(child);  // the whole child goes
+      } else {
+        if (from < to) {
+          child = own(inner->child[c]);
+          erase_at(child, from - child_offset, to - from);
+          count -= to - from;
+          bytes = STALE;
+          touched[n_touched++] = kept;
+        }
+        inner->child[kept] = child;
+        inner->count[kept] = count;
+        inner->bytes[kept] = bytes;
+        kept++;
+      }
+    }
+    inner->n = kept;
+    // the right hand one first, so merging it can't move the left one
+    for (int t = n_touched - 1; t >= 0; t--) {
+      rebalance(inner, touched[t]);
+    }
+  }
+
+  static bool run_of(Node* node, uint8_t*& start, uint8_t*& next,
+                     const uint8_t* begin, const uint8_t* end) {
+    // whether node's lines carry on from next, unedited in [begin, end)
+    // with a single line break after each; next moves past them
+    if (node->sparse) {
+      Sparse* run = (Sparse*)node;
+      if (next && run->start != next) {
+        return false;
+      }
+      start = start ? start : run->start;
+      next = run->end;
+      return true;
+    }
+    if (!node->leaf) {
+      Inner* inner = (Inner*)node;
+      for (int c = 0; c < inner->n; c++) {
+        if (!run_of(inner->child[c], start, next, begin, end)) {
+          return false;
+        }
+      }
+      return true;
+    }
+    Leaf* leaf = (Leaf*)node;
+    for (int m = 0; m < leaf->n; m++) {
+      const LineMeta& line = leaf->lines[m];
+      uint64_t size = line_break_size(line, end);
+      if (size == 0 || line.start < begin || (next && line.start != next)) {
+        return false;
+      }
+      start = start ? start : line.start;
+      next = line.start + line.size + size;
+    }
+    return true;
+  }
+
+  static void sparsify_at(Inner* inner, uint64_t offset, uint64_t keep_from, uint64_t keep_to,
+                          const uint8_t* begin, const uint8_t* end) {
+    for (int c = 0; c < inner->n; offset += inner->count[c], c++) {
+      Node* child = inner->child[c];
+      uint64_t count = inner->count[c];
+      if (child->sparse && !child->packed) {
+        continue;
+      }
+      bool kept = (offset < keep_to && offset + count > keep_from);
+      uint8_t* start = nullptr;
+      uint8_t* next = nullptr;
+      if (!kept && count <= (uint64_t)RUN_MAX && run_of(child, start, next, begin, end)) {
+        free_node(child);
+        inner->child[c] = new_run(start, next, count);
+      } else if (!child->leaf && child->refs == 1) {
+        sparsify_at((Inner*)child, offset, keep_from, keep_to, begin, end);
+      }
+    }
+  }
+
+  static void rebalance(Inner* inner, int c) {
+    // merge an underfull child with a neighbour, or even them out
+    const int LEAF_MIN = LEAF_MAX / 4;
+    const int INNER_MIN = INNER_MAX / 4;
+    Node* child = inner->child[c];
+    if (inner->n < 2 || child->n >= (child->leaf ? LEAF_MIN : INNER_MIN)) {
+      return;
+    }
+    int l = (c + 1 < inner->n) ? c : c - 1;
+    if (inner->child[l]->sparse || inner->child[l + 1]->sparse ||
+        inner->child[l]->leaf != inner->child[l + 1]->leaf) {
+      return;  // runs stay whole, and a materialized run may sit a level up
+    }
+    Node* left = own(inner->child[l]);
+    Node* right = own(inner->child[l + 1]);
+    int max = left->leaf ? LEAF_MAX : INNER_MAX;
+    int n = left->n + right->n;
+    int left_n = (n <= max) ? n : n / 2;
+    int move = left_n - left->n;  // from right to left if positive
+    if (left->leaf) {
+      Leaf* lleaf = (Leaf*)left;
+      Leaf* rleaf = (Leaf*)right;
+      if (move > 0) {
+        std::copy(rleaf->lines, rleaf->lines + move, lleaf->lines + lleaf->n);
+        std::copy(rleaf->lex, rleaf->lex + move, lleaf->lex + lleaf->n);
+        memmove(rleaf->lines, rleaf->lines + move, (rleaf->n - move) * sizeof(LineMeta));
+        memmove(rleaf->lex, rleaf->lex + move, rleaf->n - move);
+      } else if (move < 0) {
+        memmove(rleaf->lines - move, rleaf->lines, rleaf->n * sizeof(LineMeta));
+        memmove(rleaf->lex - move, rleaf->lex, rleaf->n);
+        std::copy(lleaf->lines + left_n, lleaf->lines + lleaf->n, rleaf->lines);
+        std::copy(lleaf->lex + left_n, lleaf->lex + lleaf->n, rleaf->lex);
+      }
+    } else {
+      Inner* linner = (Inner*)left;
+      Inner* rinner = (Inner*)right;
+      if (move > 0) {
+        std::copy(rinner->child, rinner->child + move, linner->child + linner->n);
+        std::copy(rinner->count, rinner->count + move, linner->count + linner->n);
+        std::copy(rinner->bytes, rinner->bytes + move, linner->bytes + linner->n);
+        memmove(rinner->child, rinner->child + move, (rinner->n - move) * sizeof(Node*));
+        memmove(rinner->count, rinner->count + move, (rinner->n - move) * sizeof(uint64_t));
+        memmove(rinner->bytes, rinner->bytes + move, (rinner->n - move) * sizeof(uint64_t));
+      } else if (move < 0) {
+        memmove(rinner->child - move, rinner->child, rinner->n * sizeof(Node*));
+        memmove(rinner->count - move, rinner->count, rinner->n * sizeof(uint64_t));
+        memmove(rinner->bytes - move, rinner->bytes, rinner->n * sizeof(uint64_t));
+        std::copy(linner->child + left_n, linner->child + linner->n, rinner->child);
+        std::copy(linner->count + left_n, linner->count + linner->n, rinner->count);
+        std::copy(linner->bytes + left_n, linner->bytes + linner->n, rinner->bytes);
+      }
+    }
+    left->n = left_n;
+    right->n = n - left_n;
+    if (right->n == 0) {
+      if (right->leaf) {
+        delete (Leaf*)right;
+        live_leaves--;
+      } else {
+        delete (Inner*)right;
+      }
+      memmove(&inner->child[l + 1], &inner->child[l + 2], (inner->n - l - 2) * sizeof(Node*));
+      memmove(&inner->count[l + 1], &inner->count[l + 2], (inner->n - l - 2) * sizeof(uint64_t));
+      memmove(&inner->bytes[l + 1], &inner->bytes[l + 2], (inner->n - l - 2) * sizeof(uint64_t));
+      inner->n--;
+      inner->count[l] = node_count(left);
+      inner->bytes[l] = STALE;
+    } else {
+      inner->count[l] = node_count(left);
+      inner->count[l + 1] = node_count(right);
+      inner->bytes[l] = STALE;
+      inner->bytes[l + 1] = STALE;
+    }
+  }
+};
+
+std::atomic<uint64_t> LineTree::live_leaves(0);
+std::atomic<uint64_t> LineTree::live_packed(0);
+std::mutex LineTree::miscounted_mutex;
+std::vector<const uint8_t*> LineTree::miscounted_runs;
+
+// The line indexers find every line break in [from, to) and append a
+// LineMeta for each line that it terminates.  `line_start` is the start of
+// the line currently being scanned and is carried in and out, so a scan can
+// be stopped and resumed at any byte.  "\r\n", "\r" and "\n" each end a
+// line; the '\n' of a "\r\n" pair is recognised by lying before
+// `line_start` (end is the end of the whole buffer, so we can peek past `to`).
+
+inline void index_line_break(uint8_t* cp, uint8_t* end, uint8_t*& line_start,
+                             std::vector<LineMeta>& lines) {
+  if (cp < line_start) {
+    return;  // second half of a "\r\n"
+  }
+  LineMeta line = {};
+  line.start = line_start;
+  line.size = cp - line_start;
+  lines.push_back(line);
+  line_start = cp + 1;
+  if (*cp == '\r' && line_start < end && *line_start == '\n') {
+    line_start++;
+  }
+}
+
+void index_lines_scalar(uint8_t* from, uint8_t* to, uint8_t* end,
+                        uint8_t*& line_start, std::vector<LineMeta>& lines) {
+  for (uint8_t* cp = from; cp < to; cp++) {
+    if (*cp == '\r' || *cp == '\n') {
+      index_line_break(cp, end, line_start, lines);
+    }
+  }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+void index_lines_sse2(uint8_t* from, uint8_t* to, uint8_t* end,
+                      uint8_t*& line_start, std::vector<LineMeta>& lines) {
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  uint8_t* cp = from;
+  for (; to - cp >= 16; cp += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*)cp);
+    uint32_t mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, cr),
+                                                   _mm_cmpeq_epi8(v, lf)));
+    while (mask) {
+      index_line_break(cp + __builtin_ctz(mask), end, line_start, lines);
+      mask &= mask - 1;
+    }
+  }
+  index_lines_scalar(cp, to, end, line_start, lines);
+}
+
+__attribute__((target("avx2")))
+void index_lines_avx2(uint8_t* from, uint8_t* to, uint8_t* end,
+                      uint8_t*& line_start, std::vector<LineMeta>& lines) {
+  const __m256i cr = _mm256_set1_epi8('\r');
+  const __m256i lf = _mm256_set1_epi8('\n');
+  uint8_t* cp = from;
+  for (; to - cp >= 64; cp += 64) {
+    __m256i lo = _mm256_loadu_si256((const __m256i*)cp);
+    __m256i hi = _mm256_loadu_si256((const __m256i*)(cp + 32));
+    uint64_t mask_lo = (uint32_t)_mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(lo, cr), _mm256_cmpeq_epi8(lo, lf)));
+    uint64_t mask_hi = (uint32_t)_mm256_movemask_epi8(
+      _mm256_or_si256(_mm256_cmpeq_epi8(hi, cr), _mm256_cmpeq_epi8(hi, lf)));
+    uint64_t mask = mask_lo | (mask_hi << 32);
+    while (mask) {
+      index_line_break(cp + __builtin_ctzll(mask), end, line_start, lines);
+      mask &= mask - 1;
+    }
+  }
+  index_lines_sse2(cp, to, end, line_start, lines);
+}
+#endif
+
+line_indexer_fn select_line_indexer() {
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return index_lines_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return index_lines_sse2;
+  }
+#endif
+  return index_lines_scalar;
+}
+
+line_indexer_fn index_lines = select_line_indexer();
+
+uint64_t estimate_line_count(const uint8_t* buffer, uint64_t size) {
+  // count the line breaks in a few samples spread through the buffer and
+  // scale up, so file_lines can be reserved once instead of regrown
+  const uint64_t SAMPLE_SIZE = 64 * 1024;
+  const int SAMPLES = 4;
+  uint64_t sampled = 0, breaks = 0;
+  for (int i = 0; i < SAMPLES; i++) {
+    uint64_t offset = size / SAMPLES * i;
+    uint64_t length = std::min(SAMPLE_SIZE, size - offset);
+    if (size <= SAMPLE_SIZE * SAMPLES) {
+      // small enough to just count the lot
+      offset = 0;
+      length = (i == 0) ? size : 0;
+    }
+    for (uint64_t j = offset; j < offset + length; j++) {
+      // a CR LF pair is one break, not two
+      uint8_t c = buffer[j];
+      breaks += (c == '\n' || (c == '\r' && (j + 1 == size || buffer[j + 1] != '\n')));
+    }
+    sampled += length;
+  }
+  if (sampled == 0) {
+    return 1;
+  }
+  // a little headroom: the estimate is cheap, a regrow of the vector is not
+  return (uint64_t)((double)breaks / sampled * size * 1.1) + 16;
+}
+
+uint64_t count_line_breaks_scalar(const uint8_t* from, const uint8_t* to) {
+  // the line breaks in [from, to) as index_lines() finds them, without
+  // building anything: a CR LF pair is one break
+  uint64_t breaks = 0;
+  for (const uint8_t* cp = from; cp < to; cp++) {
+    breaks += (*cp == '\n' || (*cp == '\r' && (cp + 1 == to || cp[1] != '\n')));
+  }
+  return breaks;
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+uint64_t count_line_breaks_sse2(const uint8_t* from, const uint8_t* to) {
+  // each '\n', and each '\r' without a '\n' straight after it, tallied in
+  // byte lanes and summed before a lane can overflow
+  const __m128i cr = _mm_set1_epi8('\r');
+  const __m128i lf = _mm_set1_epi8('\n');
+  const __m128i zero = _mm_setzero_si128();
+  __m128i total = zero;
+  const uint8_t* cp = from;
+  while (to - cp > 16) {
+    __m128i lanes = zero;
+    for (int i = 0; i < 127 && to - cp > 16; i++, cp += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i*)cp);
+      __m128i next = _mm_loadu_si128((const __m128i*)(cp + 1));
+      lanes = _mm_sub_epi8(lanes, _mm_cmpeq_epi8(v, lf));
+      lanes = _mm_sub_epi8(lanes, _mm_andnot_si128(_mm_cmpeq_epi8(next, lf), _mm_cmpeq_epi8(v, cr)));
+    }
+    total = _mm_add_epi64(total, _mm_sad_epu8(lanes, zero));
+  }
+  uint64_t halves[2];
+  _mm_storeu_si128((__m128i*)halves, total);
+  return halves[0] + halves[1] + count_line_breaks_scalar(cp, to);
+}
+#endif
+
+uint64_t count_line_breaks(const uint8_t* from, const uint8_t* to) {
+#ifdef HAVE_X86_SIMD
+  if (__builtin_cpu_supports("sse2")) {
+    return count_line_breaks_sse2(from, to);
+  }
+#endif
+  return count_line_breaks_scalar(from, to);
+}
+
+unsigned int index_lines_parallel(uint8_t* from, uint8_t* to, uint8_t* end,
+                                  uint8_t*& line_start, std::vector<LineMeta>& lines,
+                                  unsigned int threads) {
+  // Each worker indexes one chunk into its own table, starting as if a line
+  // began at the chunk edge.  That guess is only wrong for the first line of
+  // each chunk, whose real start is wherever the previous chunk left off, so
+  // stitching is a fix-up of one entry per chunk.
+  const uint64_t MIN_CHUNK_SIZE = 4 * 1024 * 1024;
+  uint64_t size = to - from;
+  if (threads > size / MIN_CHUNK_SIZE) {
+    threads = size / MIN_CHUNK_SIZE;
+  }
+  if (threads <= 1) {
+    index_lines(from, to, end, line_start, lines);
+    return 1;
+  }
+
+  std::vector<std::vector<LineMeta>> partial(threads);
+  std::vector<uint8_t*> partial_start(threads);
+  std::vector<std::thread> workers;
+  for (unsigned int i = 0; i < threads; i++) {
+    uint8_t* chunk_from = from + size / threads * i;
+    uint8_t* chunk_to = (i == threads - 1) ? to : from + size / threads * (i + 1);
+    if (i == 0) {
+      partial_start[i] = line_start;
+    } else if (*chunk_from == '\n' && chunk_from[-1] == '\r') {
+      // this '\n' finishes a "\r\n" that the previous chunk has already ended
+      partial_start[i] = chunk_from + 1;
+    } else {
+      partial_start[i] = chunk_from;
+    }
+    workers.push_back(std::thread([=, &partial, &partial_start]() {
+      partial[i].reserve(estimate_line_count(chunk_from, chunk_to - chunk_from));
+      index_lines(chunk_from, chunk_to, end, partial_start[i], partial[i]);
+    }));
+  }
+
+  uint64_t total = 0;
+  for (unsigned int i = 0; i < threads; i++) {
+    workers[i].join();
+    total += partial[i].size();
+  }
+  lines.reserve(lines.size() + total);
+  for (unsigned int i = 0; i < threads; i++) {
+    if (partial[i].size()) {
+      LineMeta& first = partial[i].front();
+      uint8_t* line_end = first.start + first.size;
+      first.start = line_start;
+      first.size = line_end - line_start;
+      line_start = partial_start[i];
+    }
+    lines.insert(lines.end(), partial[i].begin(), partial[i].end());
+  }
+  return threads;
+}
+
+// Substring search for the find dialog.  The vector versions compare the
+// first and last bytes of the needle against a whole block of positions
+// at once and only check the bytes in between where both match, which
+// keeps the scan near memory speed on text where the needle is rare.
+typedef const uint8_t* (*substring_finder_fn)(const uint8_t* text, uint64_t size,
+                                              const uint8_t* needle, uint64_t n);
+
+const uint8_t* find_substring_scalar(const uint8_t* text, uint64_t size,
+                                     const uint8_t* needle, uint64_t n) {
+  if (size < n) {
+    return nullptr;
+  }
+  return (const uint8_t*)memmem(text, size, needle, n);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("sse2")))
+const uint8_t* find_substring_sse2(const uint8_t* text, uint64_t size,
+                                   const uint8_t* needle, uint64_t n) {
+  if (n < 2 || size < n) {
+    return find_substring_scalar(text, size, needle, n);  // memchr is vectorised already
+  }
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[n - 1]);
+  uint64_t i = 0;
+  for (; i + n - 1 + 16 <= size; i += 16) {
+    __m128i block_first = _mm_loadu_si128((const __m128i*)(text + i));
+    __m128i block_last = _mm_loadu_si128((const __m128i*)(text + i + n - 1));
+    uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(block_first, first),
+                                                    _mm_cmpeq_epi8(block_last, last)));
+    while (mask) {
+      const uint8_t* candidate = text + i + __builtin_ctz(mask);
+      if (memcmp(candidate + 1, needle + 1, n - 2) == 0) {
+        return candidate;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return find_substring_scalar(text + i, size - i, needle, n);
+}
+
+__attribute__((target("avx2")))
+const uint8_t* find_substring_avx2(const uint8_t* text, uint64_t size,
+                                   const uint8_t* needle, uint64_t n) {
+  if (n < 2 || size < n) {
+    return find_substring_scalar(text, size, needle, n);
+  }
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[n - 1]);
+  uint64_t i = 0;
+  for (; i + n - 1 + 32 <= size; i += 32) {
+    __m256i block_first = _mm256_loadu_si256((const __m256i*)(text + i));
+    __m256i block_last = _mm256_loadu_si256((const __m256i*)(text + i + n - 1));
+    uint32_t mask = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(block_first, first),
+                                                          _mm256_cmpeq_epi8(block_last, last)));
+    while (mask) {
+      const uint8_t* candidate = text + i + __builtin_ctz(mask);
+      if (memcmp(candidate + 1, needle + 1, n - 2) == 0) {
+        return candidate;
+      }
+      mask &= mask - 1;
+    }
+  }
+  return find_substring_sse2(text + i, size - i, needle, n);
+}
+#endif
+
+substring_finder_fn select_substring_finder() {
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    return find_substring_avx2;
+  }
+  if (__builtin_cpu_supports("sse2")) {
+    return find_substring_sse2;
+  }
+#endif
+  return find_substring_scalar;
+}
+
+substring_finder_fn find_substring = select_substring_finder();
+
+LineTree file_lines;
+std::vector<LineMeta> cutbuffer;
+bool cut_sequence = false;
+
+FILE* file = nullptr;
+std::string filePath;
+uint8_t* fileBuffer = nullptr;
+uint64_t fileSize = 0;
+bool fileMapped = false;  // true if fileBuffer is a read-only mmap of the file
+bool dirty = false;
+uint64_t edit_generation = 0;  // bumped by every edit
+
+void mark_dirty() {
+  dirty = true;
+  edit_generation++;
+}
+
+// Large-file mode is for files too big to index whole or keep in memory:
+// the background indexer hands lines over as sparse runs (see LineTree),
+// the screen materializes the lines it shows, and memory_budget caps both
+// the leaves kept indexed and the file's pages kept mapped in.  The UI's
+// reads of the file are tracked in windows, and the least recently used
+// window goes back to the kernel once there are too many; scans on other
+// threads drop the pages behind them.  Edited lines live in edit buffers
+// and stay in leaves whatever the budget.
+const uint64_t FILE_WINDOW = 16 * 1024 * 1024;
+bool large_file = false;
+uint64_t memory_budget = 0;        // bytes
+std::vector<uint64_t> file_windows;  // the UI has read, least recent first
+
+void file_release(const uint8_t* from, const uint8_t* to) {
+  // let go of the file's pages in [from, to); they are read in again if
+  // anything touches them.  The mapping is read-only, so nothing is lost.
+  if (!large_file || !fileMapped || from < fileBuffer || to > fileBuffer + fileSize) {
+    return;
+  }
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t first = ((uintptr_t)from + page - 1) & ~(page - 1);
+  uintptr_t last = (uintptr_t)to & ~(page - 1);
+  if (first < last) {
+    madvise((void*)first, last - first, MADV_DONTNEED);
+  }
+}
+
+void file_touch(const uint8_t* p) {
+  if (!large_file || p < fileBuffer || p >= fileBuffer + fileSize) {
+    return;
+  }
+  uint64_t window = (p - fileBuffer) / FILE_WINDOW;
+  if (file_windows.size() && file_windows.back() == window) {
+    return;
+  }
+  auto it = std::find(file_windows.begin(), file_windows.end(), window);
+  if (it != file_windows.end()) {
+    file_windows.erase(it);
+  }
+  file_windows.push_back(window);
+  uint64_t max_windows = std::max((uint64_t)2, memory_budget / 2 / FILE_WINDOW);
+  if (file_windows.size() > max_windows) {
+    uint8_t* oldest = fileBuffer + file_windows.front() * FILE_WINDOW;
+    file_windows.erase(file_windows.begin());
+    file_release(oldest, oldest + FILE_WINDOW);
+  }
+}
+
+// Progressive open: only the first screenful of lines is indexed before the
+// UI starts, and a background thread indexes the rest.  The indexer never
+// touches file_lines; it hands finished lines over through index_pending and
+// the UI thread appends them in index_poll().  Anything the user does to the
+// lines seen so far happens before the unindexed tail, so appending keeps
+// the file in order.
+std::thread index_thread;
+std::mutex index_mutex;
+std::condition_variable index_cond;
+struct LineRun {
+  uint8_t* start;
+  uint8_t* end;
+  uint64_t lines;
+};
+
+std::vector<LineMeta> index_pending;   // guarded by index_mutex
+std::vector<LineRun> index_pending_runs;  // likewise, in large-file mode
+bool index_running = false;            // guarded by index_mutex
+std::atomic<bool> index_cancel(false);
+std::atomic<uint64_t> index_bytes_done(0);
+std::vector<uint64_t> index_checkpoints;  // offset of every RUN_MAX-th line, for the cache
+unsigned int index_threads = 0;  // 0 for one per core
+const unsigned int MAX_INDEX_THREADS = 256;
+unsigned int index_threads_used = 1;
+double index_time_ms = 0;
+
+bool index_busy() {
+  return index_thread.joinable();
+}
+
+void index_background(uint8_t* from, uint8_t* line_start,
+                      std::chrono::steady_clock::time_point begin) {
+  uint64_t segment_size = 64 * 1024 * 1024;
+  if (large_file) {
+    // what a segment maps in and indexes has to fit the budget too
+    segment_size = std::max((uint64_t)4 * 1024 * 1024, std::min(segment_size, memory_budget / 8));
+  }
+  const uint64_t RUN = LineTree::RUN_MAX;
+  uint8_t* end = fileBuffer + fileSize;
+  std::vector<LineMeta> lines;
+  uint64_t lines_done = 0;
+  while (from < end && !index_cancel) {
+    uint8_t* to = from + std::min(segment_size, (uint64_t)(end - from));
+    uint64_t before = lines.size();
+    unsigned int threads = index_lines_parallel(from, to, end, line_start, lines, index_threads);
+    index_threads_used = std::max(index_threads_used, threads);
+    for (uint64_t i = before; i < lines.size(); i++, lines_done++) {
+      if (lines_done % RUN == 0) {
+        index_checkpoints.push_back(lines[i].start - fileBuffer);
+      }
+    }
+    std::vector<LineRun> runs;
+    if (large_file) {
+      // whole runs go over sparse; the lines left over wait for the next
+      // segment, and the pages scanned are dropped.  The runs start at the
+      // checkpoints.
+      uint64_t r = 0;
+      for (; lines.size() - r >= RUN; r += RUN) {
+        uint8_t* run_end = (r + RUN < lines.size()) ? lines[r + RUN].start : line_start;
+        LineRun run = { lines[r].start, run_end, RUN };
+        runs.push_back(run);
+      }
+      lines.erase(lines.begin(), lines.begin() + r);
+      file_release(from, to);
+    }
+    from = to;
+    if (from == end) {
+      LineMeta last_line = {};
+      last_line.start = line_start;
+      last_line.size = end - line_start;
+      lines.push_back(last_line);
+    }
+    std::lock_guard<std::mutex> lock(index_mutex);
+    index_pending_runs.insert(index_pending_runs.end(), runs.begin(), runs.end());
+    if (!large_file || from == end) {
+      index_pending.insert(index_pending.end(), lines.begin(), lines.end());
+      lines.clear();
+    }
+    index_bytes_done = from - fileBuffer;
+    index_cond.notify_all();
+  }
+  std::chrono::duration<double, std::milli> index_time = std::chrono::steady_clock::now() - begin;
+  std::lock_guard<std::mutex> lock(index_mutex);
+  index_time_ms = index_time.count();
+  index_running = false;
+  index_cond.notify_all();
+}
+
+// The line index of a big file is kept between runs in a cache directory
+// ($XDG_CACHE_HOME/quiche, or ~/.cache/quiche), so opening the file again
+// doesn't mean scanning all of it again.  A cache holds the offset of
+// every RUN_MAX-th line the background indexer found; on open the lines
+// between checkpoints go in as sparse runs, and only the first screen and
+// the tail after the last checkpoint are indexed.  A cache is used only
+// while the file's path, size, mtime and a fingerprint of a few blocks of
+// it match what it was made from, and one that is stale or doesn't add up
+// is deleted and made again.  The least recently used caches go once the
+// directory is over index_cache_budget.
+const uint32_t INDEX_CACHE_VERSION = 1;
+const uint64_t INDEX_CACHE_MIN_SIZE = 16 * 1024 * 1024;  // smaller files index in no time
+uint64_t index_cache_budget = 64 * 1024 * 1024;  // for the directory; 0 for no cache
+
+struct IndexCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t run_lines;     // lines from one checkpoint to the next
+  uint64_t file_size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  uint64_t fingerprint;
+  uint64_t checkpoints;   // offsets after the header
+  uint64_t path_size;     // bytes of the file's path after them
+  uint64_t checksum;      // of the offsets and the path
+};
+
+std::string index_cache_file;    // the open file's cache; empty if it has none
+std::string index_cache_source;  // the open file's real path
+IndexCacheHeader index_cache_key;  // what its cache has to match
+
+uint64_t fnv1a(const void* data, uint64_t size, uint64_t hash = 14695981039346656037ull) {
+  const uint8_t* p = (const uint8_t*)data;
+  for (uint64_t i = 0; i < size; i++) {
+    hash = (hash ^ p[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+std::string index_cache_dir() {
+  const char* cache_home = getenv("XDG_CACHE_HOME");
+  if (cache_home && *cache_home == '/') {
+    return std::string(cache_home) + "/quiche";
+  }
+  const char* home = getenv("HOME");
+  if (home && *home == '/') {
+    return std::string(home) + "/.cache/quiche";
+  }
+  return "";
+}
+
+bool index_cache_open(FILE* fh) {
+  // work out where the open file's cache lives and what it must match;
+  // false if the file isn't worth a cache
+  struct stat file_stat;
+  std::string dir = index_cache_dir();
+  if (index_cache_budget == 0 || !fileMapped || fileSize < INDEX_CACHE_MIN_SIZE || dir.empty() ||
+      fstat(fileno(fh), &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+    return false;
+  }
+  char* real_path = realpath(filePath.c_str(), nullptr);
+  if (!real_path) {
+    return false;
+  }
+  index_cache_source = real_path;
+  free(real_path);
+
+  // a handful of blocks from all over the file catch most rewrites that
+  // keep its size and mtime, without reading much of it
+  const uint64_t BLOCK = 4096;
+  const uint64_t BLOCKS = 16;
+  uint64_t fingerprint = fnv1a(&fileSize, sizeof(fileSize));
+  for (uint64_t i = 0; i < BLOCKS; i++) {
+    uint64_t at = ((fileSize - BLOCK) / (BLOCKS - 1) * i) & ~(BLOCK - 1);
+    fingerprint = fnv1a(fileBuffer + at, BLOCK, fingerprint);
+    file_release(fileBuffer + at, fileBuffer + at + BLOCK);
+  }
+
+  IndexCacheHeader& key = index_cache_key;
+  memset(&key, 0, sizeof(key));
+  memcpy(key.magic, "qeindex\n", sizeof(key.magic));
+  key.version = INDEX_CACHE_VERSION;
+  key.run_lines = LineTree::RUN_MAX;
+  key.file_size = fileSize;
+  key.mtime_sec = file_stat.st_mtim.tv_sec;
+  key.mtime_nsec = file_stat.st_mtim.tv_nsec;
+  key.fingerprint = fingerprint;
+  key.path_size = index_cache_source.size();
+
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.idx",
+           (unsigned long long)fnv1a(index_cache_source.data(), index_cache_source.size()));
+  index_cache_file = dir + name;
+  return true;
+}
+
+bool index_cache_apply(const uint8_t* data, uint64_t size) {
+  // index the open file from the cache in data, if it is the right one
+  // and sound; file_lines is left part built if not
+  const IndexCacheHeader* header = (const IndexCacheHeader*)data;
+  const IndexCacheHeader& key = index_cache_key;
+  if (size < sizeof(*header) || memcmp(header->magic, key.magic, sizeof(key.magic)) != 0 ||
+      header->version != key.version || header->run_lines != key.run_lines ||
+      header->file_size != key.file_size || header->mtime_sec != key.mtime_sec ||
+      header->mtime_nsec != key.mtime_nsec || header->fingerprint != key.fingerprint ||
+      header->path_size != key.path_size) {
+    return false;
+  }
+  uint64_t n = header->checkpoints;
+  if (n == 0 || n > (size - sizeof(*header)) / sizeof(uint64_t) ||
+      size != sizeof(*header) + n * sizeof(uint64_t) + header->path_size) {
+    return false;
+  }
+  const uint64_t* offsets = (const uint64_t*)(header + 1);
+  if (memcmp(offsets + n, index_cache_source.data(), header->path_size) != 0 ||
+      fnv1a(offsets, size - sizeof(*header)) != header->checksum) {
+    return false;
+  }
+  for (uint64_t i = 0; i < n; i++) {
+    if (offsets[i] == 0 || offsets[i] >= fileSize || (i > 0 && offsets[i] <= offsets[i - 1])) {
+      return false;
+    }
+    // each checkpoint starts a line, and not in the middle of a CR LF
+    const uint8_t* p = fileBuffer + offsets[i];
+    if ((p[-1] != '\n' && p[-1] != '\r') || (p[-1] == '\r' && p[0] == '\n')) {
+      return false;
+    }
+  }
+
+  // the head has to end right at the first checkpoint, and the tail can't
+  // hold more than a run
+  uint8_t* end = fileBuffer + fileSize;
+  uint8_t* line_start = fileBuffer;
+  std::vector<LineMeta> lines;
+  index_lines(fileBuffer, fileBuffer + offsets[0], end, line_start, lines);
+  if (line_start != fileBuffer + offsets[0]) {
+    return false;
+  }
+  file_lines.append(lines.data(), lines.data() + lines.size(), end);
+  for (uint64_t i = 0; i + 1 < n; i++) {
+    // taken on trust: index_cache_recount() checks each when it is read
+    file_lines.append_run(fileBuffer + offsets[i], fileBuffer + offsets[i + 1], LineTree::RUN_MAX,
+                          false);
+  }
+  uint8_t* tail = fileBuffer + offsets[n - 1];
+  lines.clear();
+  line_start = tail;
+  index_lines(tail, end, end, line_start, lines);
+  if (lines.size() > (uint64_t)LineTree::RUN_MAX) {
+    return false;
+  }
+  LineMeta last_line = {};
+  last_line.start = line_start;
+  last_line.size = end - line_start;
+  lines.push_back(last_line);
+  file_lines.append(lines.data(), lines.data() + lines.size(), end);
+  file_release(tail, end);
+  return true;
+}
+
+bool index_cache_load() {
+  // fill file_lines from the open file's cache, if it has a good one
+  if (index_cache_file.empty()) {
+    return false;
+  }
+  int fd = open(index_cache_file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  bool ok = false;
+  struct stat cache_stat;
+  if (fstat(fd, &cache_stat) == 0 && cache_stat.st_size > 0) {
+    void* map = mmap(nullptr, cache_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map != MAP_FAILED) {
+      ok = index_cache_apply((const uint8_t*)map, cache_stat.st_size);
+      munmap(map, cache_stat.st_size);
+    }
+  }
+  if (ok) {
+    futimens(fd, nullptr);  // recently used, as far as trimming goes
+  }
+  close(fd);
+  if (!ok) {
+    // stale or broken: start over, and the indexer makes a new one
+    file_lines.clear();
+    unlink(index_cache_file.c_str());
+  }
+  return ok;
+}
+
+void index_cache_trim(const std::string& dir) {
+  // drop the least recently used caches until the directory fits the budget
+  DIR* d = opendir(dir.c_str());
+  if (!d) {
+    return;
+  }
+  std::vector<std::tuple<int64_t, uint64_t, std::string>> caches;  // mtime, size, path
+  uint64_t total = 0;
+  while (struct dirent* entry = readdir(d)) {
+    std::string path = dir + "/" + entry->d_name;
+    struct stat cache_stat;
+    if (strstr(entry->d_name, ".idx") && stat(path.c_str(), &cache_stat) == 0 &&
+        S_ISREG(cache_stat.st_mode)) {
+      caches.emplace_back(cache_stat.st_mtime, cache_stat.st_size, path);
+      total += cache_stat.st_size;
+    }
+  }
+  closedir(d);
+  std::sort(caches.begin(), caches.end());
+  for (size_t i = 0; i < caches.size() && total > index_cache_budget; i++) {
+    unlink(std::get<2>(caches[i]).c_str());
+    total -= std::get<1>(caches[i]);
+  }
+}
+
+void index_cache_save() {
+  // write the cache for the file just indexed, unless the file changed
+  // under us meanwhile.  It goes in whole or not at all, by rename.
+  struct stat file_stat;
+  IndexCacheHeader header = index_cache_key;
+  if (index_cache_file.empty() || index_checkpoints.empty() ||
+      stat(index_cache_source.c_str(), &file_stat) != 0 ||
+      (uint64_t)file_stat.st_size != header.file_size || file_stat.st_mtim.tv_sec != header.mtime_sec ||
+      file_stat.st_mtim.tv_nsec != header.mtime_nsec) {
+    return;
+  }
+  std::string dir = index_cache_file.substr(0, index_cache_file.find_last_of('/'));
+  for (size_t i = 1; i <= dir.size(); i++) {
+    if (i == dir.size() || dir[i] == '/') {
+      mkdir(dir.substr(0, i).c_str(), 0700);
+    }
+  }
+
+  header.checkpoints = index_checkpoints.size();
+  uint64_t table_size = index_checkpoints.size() * sizeof(uint64_t);
+  header.checksum = fnv1a(index_checkpoints.data(), table_size);
+  header.checksum = fnv1a(index_cache_source.data(), index_cache_source.size(), header.checksum);
+  iovec iov[3] = {
+    { &header, sizeof(header) },
+    { index_checkpoints.data(), table_size },
+    { (void*)index_cache_source.data(), index_cache_source.size() },
+  };
+  uint64_t size = sizeof(header) + table_size + index_cache_source.size();
+
+  std::string temp_path = index_cache_file + ".XXXXXX";
+  int fd = mkstemp(&temp_path[0]);
+  if (fd < 0) {
+    return;
+  }
+  bool ok = (uint64_t)writev(fd, iov, 3) == size;
+  ok = (close(fd) == 0) && ok;
+  if (!ok || rename(temp_path.c_str(), index_cache_file.c_str()) != 0) {
+    unlink(temp_path.c_str());
+    return;
+  }
+  index_cache_trim(dir);
+}
+
+// Saving writes a snapshot of file_lines from a thread of its own, so the
+// editor stays usable while a big file goes out.  save_poll() picks up the
+// result on the UI thread.
+std::thread save_thread;
+LineTree* save_snapshot = nullptr;
+std::string save_path;
+uint64_t save_generation = 0;          // edit_generation at the snapshot
+std::atomic<bool> save_running(false);
+std::atomic<bool> save_cancel(false);
+std::atomic<uint64_t> save_size(0);    // bytes to write, once known
+std::atomic<uint64_t> save_written(0);
+int save_error = 0;                    // errno, set by the save thread
+double save_seconds = 0;
+bool save_ok = false;                  // how the last save went
+
+bool save_busy() {
+  return save_thread.joinable();
+}
+
+// The regex search's results: every match in the file, in order.  They are
+// kept in buckets of a few thousand, each with a base line added to the
+// lines in it, so lines going in or out of the file only renumber the
+// matches in one bucket and move the base of the buckets after it.
+class MatchIndex {
+public:
+  struct Match {
+    uint64_t line;
+    uint32_t col;
+    uint32_t size;
+  };
+
+private:
+  static const size_t BUCKET_SIZE = 4096;
+
+  struct Bucket {
+    int64_t base;
+    std::vector<Match> matches;
+
+    uint64_t line(size_t i) const {
+      return matches[i].line + base;
+    }
+    uint64_t first() const {
+      return line(0);
+    }
+    uint64_t last() const {
+      return line(matches.size() - 1);
+    }
+  };
+
+  std::vector<Bucket> buckets;  // none of them empty
+  uint64_t total = 0;
+
+  size_t bucket_ending_after(uint64_t line) const {
+    // the first bucket with a match on or after line
+    size_t lo = 0, hi = buckets.size();
+    while (lo < hi) {
+      size_t mid = (lo + hi) / 2;
+      if (buckets[mid].last() < line) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    return lo;
+  }
+
+public:
+  uint64_t size() const {
+    return total;
+  }
+
+  void clear() {
+    buckets.clear();
+    total = 0;
+  }
+
+  void insert(const std::vector<Match>& batch) {
+    // add a batch of matches in order; the buckets it overlaps are merged
+    // with it and cut up again
+    if (batch.empty()) {
+      return;
+    }
+    size_t lo = bucket_ending_after(batch.front().line);
+    size_t hi = lo;
+    std::vector<Match> merged;
+    while (hi < buckets.size() && buckets[hi].first() <= batch.back().line) {
+      for (size_t i = 0; i < buckets[hi].matches.size(); i++) {
+        Match m = buckets[hi].matches[i];
+        m.line = buckets[hi].line(i);
+        merged.push_back(m);
+      }
+      hi++;
+    }
+    size_t existing = merged.size();
+    merged.insert(merged.end(), batch.begin(), batch.end());
+    std::inplace_merge(merged.begin(), merged.begin() + existing, merged.end(),
+                       [](const Match& a, const Match& b) {
+                         return a.line < b.line || (a.line == b.line && a.col < b.col);
+                       });
+    std::vector<Bucket> cut;
+    for (size_t i = 0; i < merged.size(); i += BUCKET_SIZE) {
+      Bucket bucket;
+      bucket.base = 0;
+      bucket.matches.assign(merged.begin() + i,
+                            merged.begin() + std::min(i + BUCKET_SIZE, merged.size()));
+      cut.push_back(std::move(bucket));
+    }
+    buckets.erase(buckets.begin() + lo, buckets.begin() + hi);
+    buckets.insert(buckets.begin() + lo, std::make_move_iterator(cut.begin()),
+                   std::make_move_iterator(cut.end()));
+    total += batch.size();
+  }
+
+  void remove(uint64_t line, uint64_t n) {
+    // forget the matches on lines [line, line + n)
+    size_t b = bucket_ending_after(line);
+    while (b < buckets.size() && buckets[b].first() < line + n) {
+      Bucket& bucket = buckets[b];
+      size_t kept = 0;
+      for (size_t i = 0; i < bucket.matches.size(); i++) {
+        if (bucket.line(i) < line || bucket.line(i) >= line + n) {
+          bucket.matches[kept++] = bucket.matches[i];
+        }
+      }
+      total -= bucket.matches.size() - kept;
+      bucket.matches.resize(kept);
+      if (kept == 0) {
+        buckets.erase(buckets.begin() + b);
+      } else {
+        b++;
+      }
+    }
+  }
+
+  void remove(const std::vector<uint64_t>& lines) {
+    // forget the matches on each of lines, which are in order, in one pass
+    size_t next = 0;
+    for (size_t b = 0; b < buckets.size(); ) {
+      Bucket& bucket = buckets[b];
+      size_t kept = 0;
+      for (size_t i = 0; i < bucket.matches.size(); i++) {
+        while (next < lines.size() && lines[next] < bucket.line(i)) {
+          next++;
+        }
+        if (next == lines.size() || lines[next] != bucket.line(i)) {
+          bucket.matches[kept++] = bucket.matches[i];
+        }
+      }
+      total -= bucket.matches.size() - kept;
+      bucket.matches.resize(kept);
+      if (kept == 0) {
+        buckets.erase(buckets.begin() + b);
+      } else {
+        b++;
+      }
+    }
+  }
+
+  void shift(uint64_t line, int64_t delta) {
+    // renumber the matches from line on by delta lines
+    size_t b = bucket_ending_after(line);
+    if (b < buckets.size() && buckets[b].first() < line) {
+      Bucket& bucket = buckets[b];
+      for (size_t i = 0; i < bucket.matches.size(); i++) {
+        if (bucket.line(i) >= line) {
+          bucket.matches[i].line += delta;
+        }
+      }
+      b++;
+    }
+    for (; b < buckets.size(); b++) {
+      buckets[b].base += delta;
+    }
+  }
+
+  void on_line(uint64_t line, std::vector<Match>& out) const {
+    for (size_t b = bucket_ending_after(line); b < buckets.size() && buckets[b].first() <= line; b++) {
+      const Bucket& bucket = buckets[b];
+      auto before = [&](const Match& m, uint64_t l) { return m.line + bucket.base < l; };
+      size_t i = std::lower_bound(bucket.matches.begin(), bucket.matches.end(), line, before) -
+                 bucket.matches.begin();
+      for (; i < bucket.matches.size() && bucket.line(i) == line; i++) {
+        Match m = bucket.matches[i];
+        m.line = line;
+        out.push_back(m);
+      }
+    }
+  }
+
+  bool next(uint64_t line, uint64_t col, bool forward, Match& out) const {
+    // the match after (line, col), or before it if not forward, wrapping
+    // round the ends of the file
+    if (total == 0) {
+      return false;
+    }
+    auto before = [&](const Bucket& bucket, size_t i) {
+      uint64_t l = bucket.line(i);
+      return l < line || (l == line && bucket.matches[i].col < col);
+    };
+    size_t b = bucket_ending_after(line);
+    size_t i = 0;
+    while (b < buckets.size() && before(buckets[b], i)) {
+      if (++i == buckets[b].matches.size()) {
+        b++;
+        i = 0;
+      }
+    }
+    // (b, i) is the first match at or after (line, col)
+    if (forward) {
+      if (b < buckets.size() && buckets[b].line(i) == line && buckets[b].matches[i].col == col) {
+        if (++i == buckets[b].matches.size()) {
+          b++;
+          i = 0;
+        }
+      }
+      if (b == buckets.size()) {
+        b = 0;
+      }
+    } else if (i > 0) {
+      i--;
+    } else {
+      b = (b == 0) ? buckets.size() - 1 : b - 1;
+      i = buckets[b].matches.size() - 1;
+    }
+    out = buckets[b].matches[i];
+    out.line = buckets[b].line(i);
+    return true;
+  }
+};
+
+// Regex search runs over a snapshot of file_lines on a thread per core,
+// each taking the next block of lines until there are none left; finished
+// blocks go through search_pending and search_poll() adds them to
+// search_matches.  Edits keep search_matches up to date as they happen:
+// changed and inserted lines are searched again on the spot and the rest
+// renumbered.  Blocks still to come are from before those edits, so each
+// edit also goes in search_journal, and search_poll() replays it on the
+// blocks to renumber them and drop what was on lines since changed.
+struct SearchEdit {
+  uint64_t line;
+  int64_t delta;  // lines inserted (or taken out, if negative) at line; 0 if it changed
+};
+
+const int SEARCH_FLAGS = REG_EXTENDED;
+
+std::vector<std::thread> search_threads;
+LineTree* search_snapshot = nullptr;
+std::string search_pattern;
+regex_t search_regex;           // for searching edited lines
+bool search_active = false;     // search_regex is compiled and search_matches is in use
+MatchIndex search_matches;
+std::vector<SearchEdit> search_journal;
+std::mutex search_mutex;
+std::vector<std::vector<MatchIndex::Match>> search_pending;  // guarded by search_mutex
+unsigned int search_running = 0;                               // guarded by search_mutex
+std::atomic<uint64_t> search_next_block(0);
+std::atomic<uint64_t> search_lines_done(0);
+std::atomic<bool> search_cancel(false);
+std::chrono::steady_clock::time_point search_begin;
+
+bool search_busy() {
+  return search_threads.size() > 0;
+}
+
+const char* line_text(const LineMeta& line_meta, std::vector<uint8_t>& copy) {
+  // a line's text in one piece for regexec(), copied out if it has a gap
+  if (line_meta.size == 0) {
+    return "";
+  }
+  if (!line_meta.has_edit_buffer()) {
+    return (const char*)line_meta.start;
+  }
+  copy.resize(line_meta.size + 1);
+  line_meta.copy_out(copy.data(), 0, line_meta.size);
+  copy[line_meta.size] = 0;
+  return (const char*)copy.data();
+}
+
+void search_line(const regex_t* regex, const LineMeta& line_meta, uint64_t line,
+                 std::vector<uint8_t>& copy, std::vector<MatchIndex::Match>& out) {
+  // add every match on a line to out; REG_STARTEND lets the text stay
+  // where it is, without a terminating NUL
+  const char* text = line_text(line_meta, copy);
+  uint64_t from = 0;
+  while (from <= line_meta.size) {
+    regmatch_t m;
+    m.rm_so = from;
+    m.rm_eo = line_meta.size;
+    if (regexec(regex, text, 1, &m, REG_STARTEND) != 0) {
+      break;
+    }
+    if (m.rm_eo > m.rm_so) {
+      // empty matches aren't worth stopping at
+      MatchIndex::Match match = { line, (uint32_t)m.rm_so, (uint32_t)(m.rm_eo - m.rm_so) };
+      out.push_back(match);
+    }
+    from = std::max((uint64_t)m.rm_eo, (uint64_t)m.rm_so + 1);
+  }
+}
+
+void search_worker(std::string pattern) {
+  // glibc's regexec locks the regex_t it runs, so each worker compiles its own
+  const uint64_t SEARCH_BLOCK = 64 * 1024;
+  regex_t regex;
+  int err = regcomp(&regex, pattern.c_str(), SEARCH_FLAGS);
+  assert(err == 0);  // it compiled once already
+  (void)err;
+  std::vector<uint8_t> copy;
+  uint64_t total = search_snapshot->size();
+  while (!search_cancel) {
+    uint64_t first = search_next_block.fetch_add(SEARCH_BLOCK);
+    if (first >= total) {
+      break;
+    }
+    uint64_t last = std::min(first + SEARCH_BLOCK, total);
+    std::vector<MatchIndex::Match> matches;
+    LineTree::iterator it = search_snapshot->begin(first);
+    const uint8_t* block_start = it.scanned_from();
+    for (; it.line() < last; ++it) {
+      search_line(&regex, *it, it.line(), copy, matches);
+    }
+    file_release(block_start, (last < total) ? it->start : fileBuffer + fileSize);
+    search_lines_done += last - first;
+    if (matches.size()) {
+      std::lock_guard<std::mutex> lock(search_mutex);
+      search_pending.push_back(std::move(matches));
+    }
+  }
+  regfree(&regex);
+  std::lock_guard<std::mutex> lock(search_mutex);
+  search_running--;
+}
+
+void search_changed(const std::vector<uint64_t>& lines) {
+  // search_edit(line, 0) for each of lines, which are in order, but with
+  // one pass over the matches
+  if (!search_active) {
+    return;
+  }
+  if (search_busy()) {
+    for (uint64_t line : lines) {
+      SearchEdit edit = { line, 0 };
+      search_journal.push_back(edit);
+    }
+  }
+  search_matches.remove(lines);
+  std::vector<MatchIndex::Match> matches;
+  std::vector<uint8_t> copy;
+  for (uint64_t line : lines) {
+    search_line(&search_regex, file_lines[line], line, copy, matches);
+  }
+  search_matches.insert(matches);
+}
+
+void search_edit(uint64_t line, int64_t delta) {
+  // keep the matches in step with an edit to file_lines (see SearchEdit)
+  if (!search_active) {
+    return;
+  }
+  if (search_busy()) {
+    SearchEdit edit = { line, delta };
+    search_journal.push_back(edit);
+  }
+  std::vector<MatchIndex::Match> matches;
+  std::vector<uint8_t> copy;
+  if (delta < 0) {
+    search_matches.remove(line, -delta);
+    search_matches.shift(line - delta, delta);
+    return;
+  } else if (delta > 0) {
+    search_matches.shift(line, delta);
+  } else {
+    search_matches.remove(line, 1);
+    delta = 1;
+  }
+  for (LineTree::iterator it = file_lines.begin(line); it.line() < line + delta; ++it) {
+    search_line(&search_regex, *it, it.line(), copy, matches);
+  }
+  search_matches.insert(matches);
+}
+
+// Syntax highlighting.  A lexer turns one line into spans of highlight
+// kinds, starting from the state the line before ended in, and returns the
+// state this line ends in.  That end state is kept with the line in
+// file_lines (see LineTree::lex_state), so drawing a line only ever lexes
+// that line.  An edit marks its line dirty in lex_dirty; lex_update()
+// re-lexes dirty lines near the screen and carries on down only while the
+// end state comes out different from the one kept.
+enum {
+  HL_NONE,
+  HL_KEYWORD,
+  HL_TYPE,
+  HL_PREPROC,
+  HL_COMMENT,
+  HL_STRING,
+  HL_NUMBER,
+  HL_KEY,
+  HL_ERROR,
+  HL_WARNING,
+  HL_INFO,
+  HL_DEBUG,
+  HL_COUNT,
+};
+
+struct HighlightSpan {
+  uint32_t from, to;
+  int kind;
+};
+
+typedef uint8_t (*lexer_fn)(const uint8_t* text, uint64_t size, uint8_t state,
+                            std::vector<HighlightSpan>* spans);
+
+void add_span(std::vector<HighlightSpan>* spans, uint64_t from, uint64_t to, int kind) {
+  if (spans && from < to) {
+    HighlightSpan span = { (uint32_t)from, (uint32_t)to, kind };
+    spans->push_back(span);
+  }
+}
+
+bool is_word_char(uint8_t c) {
+  return isalnum(c) || c == '_';
+}
+
+bool in_word_list(const char* const* words, size_t n, const uint8_t* text, uint64_t size) {
+  // words is sorted
+  const char* const* end = words + n;
+  const char* const* w = std::lower_bound(words, end, std::string((const char*)text, size),
+                                          [](const char* a, const std::string& b) { return b.compare(a) > 0; });
+  return w != end && strlen(*w) == size && memcmp(*w, text, size) == 0;
+}
+
+enum { C_NORMAL, C_COMMENT, C_PREPROC, C_STRING };  // what the line ends inside
+
+uint64_t c_string_end(const uint8_t* text, uint64_t size, uint64_t i, uint8_t quote) {
+  // just past the closing quote, or size if the string runs off the line,
+  // or size + 1 if it goes on to the next line after a backslash
+  while (i < size) {
+    if (text[i] == '\\') {
+      i += 2;
+    } else if (text[i++] == quote) {
+      return i;
+    }
+  }
+  return i;
+}
+
+uint8_t lex_c(const uint8_t* text, uint64_t size, uint8_t state, std::vector<HighlightSpan>* spans) {
+  static const char* const keywords[] = {
+    "alignas", "alignof", "asm", "break", "case", "catch", "class", "const", "const_cast",
+    "constexpr", "continue", "decltype", "default", "delete", "do", "dynamic_cast", "else",
+    "enum", "explicit", "export", "extern", "false", "final", "for", "friend", "goto", "if",
+    "inline", "mutable", "namespace", "new", "noexcept", "nullptr", "operator", "override",
+    "private", "protected", "public", "register", "reinterpret_cast", "restrict", "return",
+    "sizeof", "static", "static_assert", "static_cast", "struct", "switch", "template", "this",
+    "throw", "true", "try", "typedef", "typeid", "typename", "union", "using", "virtual",
+    "volatile", "while",
+  };
+  static const char* const types[] = {
+    "auto", "bool", "char", "char16_t", "char32_t", "double", "float", "int", "int16_t",
+    "int32_t", "int64_t", "int8_t", "long", "ptrdiff_t", "short", "signed", "size_t",
+    "ssize_t", "uint16_t", "uint32_t", "uint64_t", "uint8_t", "uintptr_t", "unsigned",
+    "void", "wchar_t",
+  };
+  bool continued = size > 0 && text[size - 1] == '\\';
+  uint64_t i = 0;
+  if (state == C_PREPROC) {
+    add_span(spans, 0, size, HL_PREPROC);
+    return continued ? C_PREPROC : C_NORMAL;
+  }
+  if (state == C_STRING) {
+    i = c_string_end(text, size, 0, '"');
+    add_span(spans, 0, std::min(i, size), HL_STRING);
+    if (i > size) {
+      return C_STRING;
+    }
+  }
+  if (state == C_COMMENT) {
+    const uint8_t* close = (const uint8_t*)memmem(text, size, "*/", 2);
+    if (!close) {
+      add_span(spans, 0, size, HL_COMMENT);
+      return C_COMMENT;
+    }
+    i = close - text + 2;
+    add_span(spans, 0, i, HL_COMMENT);
+  }
+  bool line_start = (i == 0);
+  while (i < size) {
+    uint8_t c = text[i];
+    if (c == ' ' || c == '\t') {
+      i++;
+      continue;
+    }
+    if (c == '#' && line_start) {
+      add_span(spans, i, size, HL_PREPROC);
+      return continued ? C_PREPROC : C_NORMAL;
+    }
+    line_start = false;
+    uint64_t from = i;
+    if (c == '/' && i + 1 < size && text[i + 1] == '/') {
+      add_span(spans, i, size, HL_COMMENT);
+      return C_NORMAL;
+    } else if (c == '/' && i + 1 < size && text[i + 1] == '*') {
+      const uint8_t* close = (const uint8_t*)memmem(text + i + 2, size - i - 2, "*/", 2);
+      if (!close) {
+        add_span(spans, i, size, HL_COMMENT);
+        return C_COMMENT;
+      }
+      i = close - text + 2;
+      add_span(spans, from, i, HL_COMMENT);
+    } else if (c == '"' || c == '\'') {
+      i = c_string_end(text, size, i + 1, c);
+      if (i > size) {
+        add_span(spans, from, size, HL_STRING);
+        return (c == '"') ? C_STRING : C_NORMAL;
+      }
+      add_span(spans, from, i, HL_STRING);
+    } else if (isdigit(c) || (c == '.' && i + 1 < size && isdigit(text[i + 1]))) {
+      for (i++; i < size; i++) {
+        uint8_t d = text[i];
+        bool exponent = (d == '+' || d == '-') && strchr("eEpP", text[i - 1]);
+        if (!is_word_char(d) && d != '.' && d != '\'' && !exponent) {
+          break;
+        }
+      }
+      add_span(spans, from, i, HL_NUMBER);
+    } else if (is_word_char(c)) {
+      while (i < size && is_word_char(text[i])) {
+        i++;
+      }
+      if (in_word_list(keywords, sizeof(keywords) / sizeof(*keywords), text + from, i - from)) {
+        add_span(spans, from, i, HL_KEYWORD);
+      } else if (in_word_list(types, sizeof(types) / sizeof(*types), text + from, i - from)) {
+        add_span(spans, from, i, HL_TYPE);
+      }
+    } else {
+      i++;
+    }
+  }
+  return C_NORMAL;
+}
+
+uint8_t lex_json(const uint8_t* text, uint64_t size, uint8_t state, std::vector<HighlightSpan>* spans) {
+  // JSON strings can't span lines, so every line starts afresh
+  (void)state;
+  uint64_t i = 0;
+  while (i < size) {
+    uint8_t c = text[i];
+    uint64_t from = i;
+    if (c == '"') {
+      i = std::min(c_string_end(text, size, i + 1, '"'), size);
+      uint64_t next = i;
+      while (next < size && (text[next] == ' ' || text[next] == '\t')) {
+        next++;
+      }
+      add_span(spans, from, i, (next < size && text[next] == ':') ? HL_KEY : HL_STRING);
+    } else if (c == '-' || isdigit(c)) {
+      for (i++; i < size && (isalnum(text[i]) || strchr(".+-", text[i])); i++) {
+      }
+      add_span(spans, from, i, HL_NUMBER);
+    } else if (isalpha(c)) {
+      while (i < size && isalpha(text[i])) {
+        i++;
+      }
+      add_span(spans, from, i, HL_KEYWORD);  // true, false and null
+    } else {
+      i++;
+    }
+  }
+  return 0;
+}
+
+uint8_t lex_log(const uint8_t* text, uint64_t size, uint8_t state, std::vector<HighlightSpan>* spans) {
+  // the state is the severity of the entry; an indented line (a stack
+  // trace, say) carries on the entry above it
+  static const struct { const char* word; int kind; } levels[] = {
+    { "CRITICAL", HL_ERROR }, { "ERROR", HL_ERROR }, { "FATAL", HL_ERROR }, { "SEVERE", HL_ERROR },
+    { "WARNING", HL_WARNING }, { "WARN", HL_WARNING }, { "INFO", HL_INFO }, { "NOTICE", HL_INFO },
+    { "DEBUG", HL_DEBUG }, { "TRACE", HL_DEBUG },
+  };
+  if (size > 0 && (text[0] == ' ' || text[0] == '\t')) {
+    if (state == HL_ERROR || state == HL_WARNING) {
+      add_span(spans, 0, size, state);
+    }
+    return state;
+  }
+  // a leading timestamp
+  uint64_t i = 0;
+  while (i < size && (isdigit(text[i]) || strchr("-:.,/T ", text[i]))) {
+    i++;
+  }
+  while (i > 0 && text[i - 1] == ' ') {
+    i--;
+  }
+  add_span(spans, 0, i, HL_NUMBER);
+  // the first severity word, as a whole word, within the first 100 bytes
+  uint64_t limit = std::min(size, (uint64_t)100);
+  for (; i < limit; i++) {
+    if (!isupper(text[i]) || (i > 0 && is_word_char(text[i - 1]))) {
+      continue;
+    }
+    for (auto& level : levels) {
+      size_t n = strlen(level.word);
+      if (i + n <= size && memcmp(text + i, level.word, n) == 0 &&
+          (i + n == size || !is_word_char(text[i + n]))) {
+        if (level.kind == HL_ERROR || level.kind == HL_WARNING) {
+          if (spans) {
+            spans->clear();  // the whole line stands out instead
+          }
+          add_span(spans, 0, size, level.kind);
+        } else {
+          add_span(spans, i, i + n, level.kind);
+        }
+        return level.kind;
+      }
+    }
+  }
+  return HL_NONE;
+}
+
+struct Syntax {
+  const char* name;
+  const char* extensions;  // space separated, each with a trailing space
+  lexer_fn lex;
+};
+
+const Syntax syntaxes[] = {
+  { "C/C++", ".c .h .cc .cpp .cxx .c++ .hh .hpp .hxx .h++ .inl .ino ", lex_c },
+  { "JSON", ".json .geojson ", lex_json },
+  { "log", ".log .out ", lex_log },
+};
+
+const Syntax* syntax = nullptr;  // none for plain text
+std::vector<uint64_t> lex_dirty;  // in order; lines whose end state is suspect
+
+const Syntax* find_syntax(const std::string& path) {
+  size_t slash = path.rfind('/');
+  std::string name = path.substr(slash == std::string::npos ? 0 : slash + 1);
+  size_t dot = name.rfind('.');
+  if (dot != std::string::npos && dot > 0) {
+    std::string extension = name.substr(dot);
+    for (char& c : extension) {
+      c = tolower(c);
+    }
+    extension += ' ';
+    for (const Syntax& s : syntaxes) {
+      if (strstr(s.extensions, extension.c_str())) {
+        return &s;
+      }
+    }
+  }
+  if (name.find("log") != std::string::npos) {
+    return &syntaxes[2];  // syslog, messages.log.1 and the like
+  }
+  return nullptr;
+}
+
+void lex_mark(uint64_t line) {
+  auto it = std::lower_bound(lex_dirty.begin(), lex_dirty.end(), line);
+  if (it == lex_dirty.end() || *it != line) {
+    lex_dirty.insert(it, line);
+  }
+}
+
+void lex_changed(const std::vector<uint64_t>& lines) {
+  // lex_edit(line, 0) for each of lines, which are in order
+  if (!syntax) {
+    return;
+  }
+  std::vector<uint64_t> merged;
+  std::set_union(lex_dirty.begin(), lex_dirty.end(), lines.begin(), lines.end(),
+                 std::back_inserter(merged));
+  lex_dirty.swap(merged);
+}
+
+void lex_edit(uint64_t line, int64_t delta) {
+  // keep lex_dirty in step with an edit to file_lines, like search_edit();
+  // inserted lines are unlexed, and the line after a removal may now
+  // start in a different state
+  if (!syntax) {
+    return;
+  }
+  if (delta != 0) {
+    auto it = std::lower_bound(lex_dirty.begin(), lex_dirty.end(), line);
+    for (auto d = it; d != lex_dirty.end(); ++d) {
+      *d = (delta < 0 && *d < line - delta) ? line : *d + delta;
+    }
+    lex_dirty.erase(std::unique(it, lex_dirty.end()), lex_dirty.end());
+    if (lex_dirty.size() && lex_dirty.back() >= file_lines.size()) {
+      lex_dirty.pop_back();  // the lines at the end went
+    }
+  }
+  if (line < file_lines.size()) {
+    lex_mark(line);
+  }
+}
+
+int first_line = 0;
+int left_margin = 0;
+int cx = 0, cy = 0;
+int preferred_cx = 0;
+// with soft wrap, Up and Down keep to preferred_col for as long as the
+// cursor stays where the last of them left it
+uint64_t preferred_col = 0;
+int preferred_col_cy = -1, preferred_col_cx = -1;
+
+// Damage tracking: display_file() only rebuilds rows whose lines have been
+// damaged since the last frame.  The edit primitives damage the line they
+// change, or every line from there down when lines are inserted or erased.
+// Damage is kept as file lines, not screen rows, so it stays right however
+// far we scroll before the next frame.
+std::vector<uint64_t> damaged_lines;
+uint64_t damaged_from = 0;   // every line from here on is damaged
+int drawn_cy = -1;
+int drawn_left_margin = -1;
+int drawn_lines = -1, drawn_cols = -1;
+int rows_repainted = 0;      // in the last frame
+uint64_t rows_repainted_total = 0;
+bool stats_visible = false;
+
+// the find dialog's match, drawn highlighted (-1 for none)
+int64_t find_match_line = -1;
+uint64_t find_match_col = 0, find_match_size = 0;
+
+void damage_line(uint64_t line) {
+  if (line < damaged_from) {
+    damaged_lines.push_back(line);
+  }
+}
+
+void damage_from(uint64_t line) {
+  damaged_from = std::min(damaged_from, line);
+}
+
+void damage_all() {
+  damaged_from = 0;
+}
+
+bool line_damaged(uint64_t line) {
+  if (line >= damaged_from) {
+    return true;
+  }
+  return std::find(damaged_lines.begin(), damaged_lines.end(), line) != damaged_lines.end();
+}
+
+// Visual layout: with soft wrap a line takes a screen row for every
+// view_width() columns of it, and without it a line scrolled sideways is
+// drawn from the byte at first_col.  Either way finding where a row starts
+// means walking the line from its start, which for a 10MB line is far too
+// slow to do every frame, so layouts keeps where the rows of the lines
+// around the screen start (unwrapped, a checkpoint every LAYOUT_STRIDE
+// columns).  A layout is only walked as far as something has asked for,
+// and the edit primitives drop the layouts of the lines they change.
+struct Layout {
+  int width = 0;                   // columns per row, or LAYOUT_STRIDE
+  bool done = false;               // the walk has reached the line's end
+  uint64_t pos = 0, pos_col = 0;   // and otherwise how far it got
+  std::vector<uint64_t> starts;    // the byte each row starts at
+  std::vector<uint64_t> cols;      // and the column that byte is in
+};
+
+const int LAYOUT_STRIDE = 4096;
+const size_t LAYOUT_MAX_LINES = 4096;  // before far off layouts are dropped
+std::map<uint64_t, Layout> layouts;
+bool soft_wrap = false;
+int first_row = 0;       // the row of first_line at the top, with soft wrap
+uint64_t first_col = 0;  // the column at the left edge, without it
+
+struct ScreenRow {
+  int line, row;
+  bool operator==(const ScreenRow& other) const {
+    return line == other.line && row == other.row;
+  }
+};
+std::vector<ScreenRow> drawn_rows;  // what each row on screen shows
+uint64_t drawn_first_col = 0;
+
+void layout_edit(uint64_t line, int64_t delta, uint64_t col = 0) {
+  // keep layouts in step with an edit to file_lines, like lex_edit(): the
+  // line changed from col on is walked afresh, and the ones after an
+  // insertion or a removal move with their lines
+  auto it = layouts.lower_bound(line);
+  if (delta == 0) {
+    if (it != layouts.end() && it->first == line) {
+      // a row start depends on the characters up to and including the one
+      // it starts at, and one of those may run on into the edit
+      Layout& layout = it->second;
+      size_t keep = std::lower_bound(layout.starts.begin(), layout.starts.end(),
+                                     col > MB_LEN_MAX ? col - MB_LEN_MAX : 0) - layout.starts.begin();
+      keep = std::max(keep, (size_t)1);
+      layout.starts.resize(keep);
+      layout.cols.resize(keep);
+      layout.pos = layout.starts.back();
+      layout.pos_col = layout.cols.back();
+      layout.done = false;
+    }
+    return;
+  }
+  std::vector<std::pair<uint64_t, Layout>> moved;
+  for (; it != layouts.end(); it = layouts.erase(it)) {
+    if (delta > 0 || it->first >= line - delta) {
+      moved.emplace_back(it->first + delta, std::move(it->second));
+    }
+  }
+  for (auto& m : moved) {
+    layouts.emplace_hint(layouts.end(), m.first, std::move(m.second));
+  }
+}
+
+void layout_changed(const std::vector<uint64_t>& lines) {
+  for (uint64_t line : lines) {
+    layouts.erase(line);
+  }
+}
+
+time_t cl_message_time = 0;
+std::string cl_message;
+int cl_message_level = 0;
+
+template<typename... Args>
+void strprintf(std::string& s, const char* fmt, Args&&... args) {
+  int string_size = snprintf(nullptr, 0, fmt, args...);
+  s.reserve(string_size + 1);
+  snprintf(&s[0], string_size + 1, fmt, args...);
+}
+
+template<typename... Args>
+void printcl(int level, const char* fmt, Args&&... args) {
+  cl_message_time = time(nullptr);
+  cl_message_level = level;
+  strprintf(cl_message, fmt, args...);
+}
+
+enum {
+  COLOR_PAIR_LINENUM = 1,
+  COLOR_PAIR_LINENUM_SHADED,
+  COLOR_PAIR_LINE_SHADED,
+  COLOR_PAIR_ERROR,
+  COLOR_PAIR_SYNTAX = 16,  // plus a highlight kind
+  COLOR_PAIR_SYNTAX_SHADED = COLOR_PAIR_SYNTAX + HL_COUNT,
+  COLOR_PINK = 101,
+  COLOR_LINE_SHADE,
+  COLOR_GRAY,
+};
+
+#define CTRL(x) ((x) & 0x1f)
+
+void bracketed_paste(bool on) {
+  // ask the terminal to mark pasted text, see KEY_PASTE_BEGIN
+  putp(on ? "\033[?2004h" : "\033[?2004l");
+  fflush(stdout);
+}
+
+void handle_sigwinch(int signal) {
+  window_resized = true;
+}
+
+void handle_sigcont(int signal) {
+  window_resized = true;
+}
+
+// Undo.  Every change to file_lines goes through the primitives below, and
+// each one logs a small record of what it did: the bytes typed or deleted,
+// where a line was split or joined, or the LineMetas of whole lines put in,
+// taken out or swapped for others (holding references to their buffers, so
+// a big cut costs the log no more than it cost the cutbuffer).  Undoing a record runs the
+// opposite primitive with logging off.  Typing and deleting in one place
+// add to the last record instead of starting another, and all the records
+// one key makes are undone together.
+struct UndoRecord {
+  enum Type { INSERT_TEXT, DELETE_TEXT, SPLIT, JOIN, INSERT_LINES, REMOVE_LINES, REPLACE_LINES };
+  Type type;
+  uint64_t action;  // the key that made it
+  uint64_t line;
+  uint64_t col;
+  std::string text;               // INSERT_TEXT, DELETE_TEXT
+  std::vector<LineMeta> lines;    // INSERT_LINES, REMOVE_LINES; the old lines for REPLACE_LINES
+  std::vector<LineMeta> replacements;  // REPLACE_LINES
+  std::vector<uint64_t> numbers;       // REPLACE_LINES, the lines replaced
+
+  uint64_t memory() const {
+    return sizeof(UndoRecord) + text.capacity() +
+           (lines.capacity() + replacements.capacity()) * sizeof(LineMeta) +
+           numbers.capacity() * sizeof(uint64_t);
+  }
+  void release() {
+    for (LineMeta& line_meta : lines) {
+      line_meta.release();
+    }
+    for (LineMeta& line_meta : replacements) {
+      line_meta.release();
+    }
+  }
+};
+
+std::deque<UndoRecord> undo_log;
+std::vector<UndoRecord> redo_log;
+uint64_t undo_memory = 0;   // of both logs
+uint64_t undo_budget = 64 * 1024 * 1024;
+uint64_t undo_action = 0;
+bool undo_logging = true;
+
+void undo_drop(UndoRecord& record) {
+  undo_memory -= record.memory();
+  record.release();
+}
+
+void undo_trim() {
+  // forget the oldest keys' records until the log is back within budget
+  if (!undo_logging) {
+    return;
+  }
+  while (undo_memory > undo_budget && undo_log.size() &&
+         undo_log.front().action != undo_log.back().action) {
+    uint64_t action = undo_log.front().action;
+    while (undo_log.front().action == action) {
+      undo_drop(undo_log.front());
+      undo_log.pop_front();
+    }
+  }
+}
+
+UndoRecord* undo_add(UndoRecord::Type type, uint64_t line, uint64_t col) {
+  // start a record, or return null when not logging
+  if (!undo_logging) {
+    return nullptr;
+  }
+  for (UndoRecord& record : redo_log) {
+    undo_drop(record);
+  }
+  redo_log.clear();
+  undo_log.push_back(UndoRecord());
+  UndoRecord& record = undo_log.back();
+  record.type = type;
+  record.action = undo_action;
+  record.line = line;
+  record.col = col;
+  undo_memory += record.memory();
+  return &record;
+}
+
+UndoRecord* undo_top() {
+  // the last record if this key can add to it: only a record that is all
+  // an earlier key did can be taken over, or undo would stop halfway
+  // through what that key did
+  if (undo_log.empty() || redo_log.size()) {
+    return nullptr;
+  }
+  UndoRecord& top = undo_log.back();
+  if (top.action != undo_action && undo_log.size() > 1 &&
+      undo_log[undo_log.size() - 2].action == top.action) {
+    return nullptr;
+  }
+  return &top;
+}
+
+void undo_add_text(UndoRecord::Type type, uint64_t line, uint64_t col,
+                   const LineMeta& line_meta, uint64_t n) {
+  // log n bytes of line_meta from col being inserted or deleted
+  if (!undo_logging || n == 0) {
+    return;
+  }
+  std::string text(n, 0);
+  line_meta.copy_out((uint8_t*)&text[0], col, col + n);
+  UndoRecord* last = undo_top();
+  if (last && last->type == type && last->line == line) {
+    uint64_t before = last->memory();
+    if (type == UndoRecord::INSERT_TEXT && col == last->col + last->text.size()) {
+      last->text += text;  // typing on
+    } else if (type == UndoRecord::DELETE_TEXT && col == last->col) {
+      last->text += text;  // deleting forwards
+    } else if (type == UndoRecord::DELETE_TEXT && col + n == last->col) {
+      last->text.insert(0, text);  // backspacing
+      last->col = col;
+    } else {
+      last = nullptr;
+    }
+    if (last) {
+      last->action = undo_action;
+      undo_memory += last->memory() - before;
+      undo_trim();
+      return;
+    }
+  }
+  UndoRecord* record = undo_add(type, line, col);
+  record->text.swap(text);
+  undo_memory += record->text.capacity();
+  undo_trim();
+}
+
+void undo_add_lines(UndoRecord::Type type, uint64_t line, const LineMeta* first,
+                    const LineMeta* last) {
+  // log whole lines going in or out, taking references of our own
+  if (!undo_logging || first == last) {
+    return;
+  }
+  UndoRecord* record = nullptr;
+  UndoRecord* top = undo_top();
+  if (top && type == UndoRecord::REMOVE_LINES && top->type == type && top->line == line) {
+    record = top;  // cutting one line after another
+    record->action = undo_action;
+  } else {
+    record = undo_add(type, line, 0);
+  }
+  undo_memory -= record->memory();
+  for (const LineMeta* line_meta = first; line_meta != last; line_meta++) {
+    record->lines.push_back(line_meta->share());
+  }
+  undo_memory += record->memory();
+  undo_trim();
+}
+
+void insert_text(unsigned int line, unsigned int col, const uint8_t* text, uint64_t n) {
+  assert(line < file_lines.size());
+  LineMeta& line_meta = file_lines.edit(line);
+  assert(col <= line_meta.size);
+  line_meta.insert(col, text, n);
+  undo_add_text(UndoRecord::INSERT_TEXT, line, col, line_meta, n);
+  search_edit(line, 0);
+  lex_edit(line, 0);
+  layout_edit(line, 0, col);
+  damage_line(line);
+  mark_dirty();
+}
+
+void remove_text(unsigned int line, unsigned int col, uint64_t n) {
+  assert(line < file_lines.size());
+  LineMeta& line_meta = file_lines.edit(line);
+  assert(col + n <= line_meta.size);
+  undo_add_text(UndoRecord::DELETE_TEXT, line, col, line_meta, n);
+  line_meta.make_gap(0);
+  line_meta.move_gap(col);
+  line_meta.size -= n;  // the gap swallows the bytes after it
+  search_edit(line, 0);
+  lex_edit(line, 0);
+  layout_edit(line, 0, col);
+  damage_line(line);
+  mark_dirty();
+}
+
+void split_line(unsigned int line, unsigned int col) {
+  assert(line < file_lines.size());
+  LineMeta& first_line = file_lines.edit(line);
+  assert(col <= first_line.size);
+
+  LineMeta second_line = first_line.slice(col, first_line.size);
+  first_line.truncate(col);
+
+  file_lines.insert(line + 1, second_line);
+  undo_add(UndoRecord::SPLIT, line, col);
+  undo_trim();
+  search_edit(line + 1, 1);
+  lex_edit(line + 1, 1);
+  layout_edit(line + 1, 1);
+  search_edit(line, 0);
+  lex_edit(line, 0);
+  layout_edit(line, 0, col);
+  damage_from(line);
+  mark_dirty();
+}
+
+void insert_lines(unsigned int line, const LineMeta* first, const LineMeta* last) {
+  // the lines (and the references they hold) go into the file
+  assert(line <= file_lines.size());
+  file_lines.insert(line, first, last);
+  undo_add_lines(UndoRecord::INSERT_LINES, line, first, last);
+  search_edit(line, last - first);
+  lex_edit(line, last - first);
+  layout_edit(line, last - first);
+  damage_from(line);
+  mark_dirty();
+}
+
+void remove_lines(unsigned int line, uint64_t n, std::vector<LineMeta>& out) {
+  // take n lines out of the file and hand them (and their references) over
+  assert(line + n <= file_lines.size());
+  uint64_t out_size = out.size();
+  for (LineTree::iterator it = file_lines.begin(line); it.line() < line + n; ++it) {
+    out.push_back(*it);
+  }
+  undo_add_lines(UndoRecord::REMOVE_LINES, line, out.data() + out_size, out.data() + out.size());
+  file_lines.erase(line, n);
+  search_edit(line, -(int64_t)n);
+  lex_edit(line, -(int64_t)n);
+  layout_edit(line, -(int64_t)n);
+  damage_from(line);
+  mark_dirty();
+}
+
+void replace_lines(const std::vector<uint64_t>& numbers, std::vector<LineMeta>& lines) {
+  // swap each of lines in for the line numbers gives it, in order; the
+  // lines taken out are handed back in lines
+  assert(numbers.size() == lines.size());
+  if (numbers.empty()) {
+    return;
+  }
+  for (size_t i = 0; i < numbers.size(); i++) {
+    assert(numbers[i] < file_lines.size() && (i == 0 || numbers[i - 1] < numbers[i]));
+    std::swap(file_lines.edit(numbers[i]), lines[i]);
+  }
+  search_changed(numbers);
+  lex_changed(numbers);
+  layout_changed(numbers);
+  UndoRecord* record = undo_add(UndoRecord::REPLACE_LINES, numbers.front(), 0);
+  if (record) {
+    undo_memory -= record->memory();
+    record->numbers = numbers;
+    record->lines.reserve(lines.size());
+    record->replacements.reserve(lines.size());
+    for (size_t i = 0; i < numbers.size(); i++) {
+      record->lines.push_back(lines[i].share());
+      record->replacements.push_back(file_lines[numbers[i]].share());
+    }
+    undo_memory += record->memory();
+    undo_trim();
+  }
+  damage_all();
+  mark_dirty();
+}
+
+void do_putc(char c, unsigned int line, unsigned int col) {
+  insert_text(line, col, (const uint8_t*)&c, 1);
+}
+
+void pad(unsigned int line, unsigned int col) {
+  assert(line < file_lines.size());
+  uint64_t size = file_lines[line].size;
+  if (col >= size) {
+    // one run of spaces out to and including col
+    std::string spaces(col - size + 1, ' ');
+    insert_text(line, size, (const uint8_t*)spaces.data(), spaces.size());
+  }
+  assert(file_lines[line].size >= col);
+}
+
+void putc(char c, unsigned int line, unsigned int col) {
+  pad(line, col);
+  do_putc(c, line, col);
+}
+
+void removec(unsigned int line, unsigned int col) {
+  pad(line, col);
+  remove_text(line, col, 1);
+}
+
+void putnl(unsigned int line, unsigned int col) {
+  pad(line, col);
+  split_line(line, col);
+}
+
+void combine_lines(unsigned int line1, unsigned int line2) {
+  assert(line1 < file_lines.size());
+  assert(line2 < file_lines.size());
+  // this is probably not strictly required, but we probably don't
+  // want to combine in the wrong order
+  assert(line1 < line2);
+
+  LineMeta& first_line = file_lines.edit(line1);
+  LineMeta second_line = file_lines[line2];
+  uint64_t col = first_line.size;
+
+  // append the second line in the first one's gap
+  first_line.make_gap(second_line.size);
+  first_line.move_gap(first_line.size);
+  second_line.copy_out(first_line.start + first_line.gap, 0, second_line.size);
+  first_line.gap += second_line.size;
+  first_line.size += second_line.size;
+
+  file_lines.erase(line2);
+  second_line.release();  // only once it is out of the tree
+  search_edit(line2, -1);
+  lex_edit(line2, -1);
+  layout_edit(line2, -1);
+  search_edit(line1, 0);
+  lex_edit(line1, 0);
+  layout_edit(line1, 0, col);
+  if (line2 == line1 + 1) {
+    undo_add(UndoRecord::JOIN, line1, col);
+    undo_trim();
+  }
+  damage_from(line1);
+  mark_dirty();
+}
+
+void cut_line(unsigned int line) {
+  // the file always keeps a line: cutting the only one leaves an empty
+  // one, added first so undo never empties the file
+  if (file_lines.size() == 1) {
+    LineMeta empty = LineMeta::copy_of((const uint8_t*)"", 0);
+    insert_lines(1, &empty, &empty + 1);
+  }
+  remove_lines(line, 1, cutbuffer);
+}
+
+void clear_cutbuffer() {
+  for (LineMeta& line_meta : cutbuffer) {
+    line_meta.release();
+  }
+  cutbuffer.clear();
+}
+
+void insert_cutbuffer(unsigned int line) {
+  assert(line < file_lines.size());
+  // the cutbuffer keeps its lines for the next paste, so insert shared
+  // copies of them
+  std::vector<LineMeta> lines;
+  lines.reserve(cutbuffer.size());
+  for (const LineMeta& line_meta : cutbuffer) {
+    lines.push_back(line_meta.share());
+  }
+  insert_lines(line, lines.data(), lines.data() + lines.size());
+}
+
+void duplicate_line(unsigned int line) {
+  assert(line < file_lines.size());
+  LineMeta copy = file_lines[line].share();
+  insert_lines(line + 1, &copy, &copy + 1);
+}
+
+uint64_t paste_text(unsigned int line, unsigned int col, uint8_t* text, uint64_t size) {
+  // insert a block of text at (line, col) in one go: split it into lines
+  // with the loader's line indexer and splice those into file_lines with a
+  // single insert.  Returns the number of lines the text ended up adding.
+  assert(line < file_lines.size());
+  std::vector<LineMeta> lines;
+  uint8_t* line_start = text;
+  index_lines_parallel(text, text + size, text + size, line_start, lines, index_threads);
+  uint64_t last_size = text + size - line_start;
+
+  if (col > 0) {
+    pad(line, col - 1);  // spaces out to col if the cursor is past the end
+  }
+  if (lines.empty()) {
+    insert_text(line, col, line_start, last_size);
+    return 0;
+  }
+
+  // split the line at col, finish the first half with the first pasted
+  // line, put the rest of them in between and start the second half with
+  // the text after the last line break
+  split_line(line, col);
+  insert_text(line, col, lines[0].start, lines[0].size);
+  for (LineMeta& line_meta : lines) {
+    // the pasted lines only point into text so far; give each a buffer
+    line_meta = LineMeta::copy_of(line_meta.start, line_meta.size);
+  }
+  lines[0].release();
+  insert_lines(line + 1, lines.data() + 1, lines.data() + lines.size());
+  insert_text(line + lines.size(), 0, line_start, last_size);
+  return lines.size();
+}
+
+void undo_apply(const UndoRecord& record, bool forward, int& line, int& col) {
+  // redo the record, or undo it if not forward, and put the cursor there
+  uint64_t n = record.text.size();
+  bool insert = (record.type == UndoRecord::INSERT_TEXT) == forward;
+  line = record.line;
+  col = record.col;
+  switch (record.type) {
+  case UndoRecord::INSERT_TEXT:
+  case UndoRecord::DELETE_TEXT:
+    if (insert) {
+      insert_text(line, col, (const uint8_t*)record.text.data(), n);
+      col += n;
+    } else {
+      remove_text(line, col, n);
+    }
+    break;
+  case UndoRecord::SPLIT:
+  case UndoRecord::JOIN:
+    if ((record.type == UndoRecord::SPLIT) == forward) {
+      split_line(line, col);
+      line++;
+      col = 0;
+    } else {
+      combine_lines(line, line + 1);
+    }
+    break;
+  case UndoRecord::INSERT_LINES:
+  case UndoRecord::REMOVE_LINES:
+    col = 0;
+    if ((record.type == UndoRecord::INSERT_LINES) == forward) {
+      std::vector<LineMeta> lines;
+      lines.reserve(record.lines.size());
+      for (const LineMeta& line_meta : record.lines) {
+        lines.push_back(line_meta.share());
+      }
+      insert_lines(line, lines.data(), lines.data() + lines.size());
+    } else {
+      std::vector<LineMeta> lines;
+      remove_lines(line, record.lines.size(), lines);
+      for (LineMeta& line_meta : lines) {
+        line_meta.release();
+      }
+    }
+    break;
+  case UndoRecord::REPLACE_LINES: {
+    col = 0;
+    std::vector<LineMeta> lines;
+    lines.reserve(record.lines.size());
+    for (const LineMeta& line_meta : forward ? record.replacements : record.lines) {
+      lines.push_back(line_meta.share());
+    }
+    replace_lines(record.numbers, lines);
+    for (LineMeta& line_meta : lines) {
+      line_meta.release();
+    }
+    break;
+  }
+  }
+}
+
+bool undo(int& line, int& col) {
+  // undo everything the last key did
+  if (undo_log.empty()) {
+    return false;
+  }
+  uint64_t action = undo_log.back().action;
+  undo_logging = false;
+  while (undo_log.size() && undo_log.back().action == action) {
+    undo_apply(undo_log.back(), false, line, col);
+    redo_log.push_back(std::move(undo_log.back()));
+    undo_log.pop_back();
+  }
+  undo_logging = true;
+  return true;
+}
+
+bool redo(int& line, int& col) {
+  if (redo_log.empty()) {
+    return false;
+  }
+  uint64_t action = redo_log.back().action;
+  undo_logging = false;
+  while (redo_log.size() && redo_log.back().action == action) {
+    undo_apply(redo_log.back(), true, line, col);
+    undo_log.push_back(std::move(redo_log.back()));
+    redo_log.pop_back();
+  }
+  undo_logging = true;
+  return true;
+}
+
+// Rows are built up as cells in row_cells and put on screen with a single
+// call, instead of a curses call per character.  UTF-8 is decoded, tabs
+// are expanded and control characters are spelled out as ^X while the row
+// is built.
+std::vector<cchar_t> row_cells;
+int row_width = 0;  // screen columns taken by row_cells
+
+void row_clear() {
+  row_cells.clear();
+  row_width = 0;
+}
+
+void row_add(wchar_t wc, int width, attr_t attr, short pair) {
+  wchar_t wstr[2] = { wc, 0 };
+  cchar_t cell;
+  setcchar(&cell, wstr, attr, pair, nullptr);
+  row_cells.push_back(cell);
+  row_width += width;
+}
+
+void row_fill(int width, attr_t attr, short pair) {
+  while (row_width < width) {
+    row_add(' ', 1, attr, pair);
+  }
+}
+
+void row_add_char(wchar_t wc, int width, attr_t attr, short pair) {
+  // a character taking width columns: a tab as blanks, a control
+  // character as ^X and a combining character in with the one before it
+  if (wc == '\t') {
+    for (int t = 0; t < width; t++) {
+      row_add(' ', 1, attr, pair);
+    }
+  } else if (wc < ' ' || wc == 0x7f) {
+    row_add('^', 1, attr, pair);
+    row_add(wc ^ 0x40, 1, attr, pair);
+  } else if (width == 0) {
+    if (row_cells.size()) {
+      cchar_t& cell = row_cells.back();
+      wchar_t wstr[CCHARW_MAX + 1];
+      attr_t cell_attr;
+      short cell_pair;
+      getcchar(&cell, wstr, &cell_attr, &cell_pair, nullptr);
+      size_t chars = wcslen(wstr);
+      if (chars < CCHARW_MAX) {
+        wstr[chars] = wc;
+        wstr[chars + 1] = 0;
+        setcchar(&cell, wstr, cell_attr, cell_pair, nullptr);
+      }
+    }
+  } else {
+    row_add(wc, width, attr, pair);
+  }
+}
+
+uint64_t row_add_text(const uint8_t* text, uint64_t size, attr_t attr, short pair,
+                      int max_width, mbstate_t& state) {
+  // add as much of text as fits in max_width columns, returning the number
+  // of bytes used up; state carries a character split across two calls
+  uint64_t i = 0;
+  while (i < size) {
+    uint8_t c = text[i];
+    wchar_t wc = c;
+    uint64_t length = 1;
+    int width = 1;
+    if (c >= 0x80 || !mbsinit(&state)) {
+      size_t n = mbrtowc(&wc, (const char*)text + i, size - i, &state);
+      if (n == (size_t)-2) {
+        return size;  // the rest of this character comes in the next call
+      }
+      if (n == (size_t)-1) {
+        memset(&state, 0, sizeof(state));
+        wc = 0xfffd;  // replacement character
+      } else {
+        length = n;
+      }
+      width = wcwidth(wc);
+      if (width < 0) {
+        wc = 0xfffd;
+        width = 1;
+      }
+    }
+    if (c == '\t') {
+      width = TABSIZE - row_width % TABSIZE;
+    } else if (wc < ' ' || wc == 0x7f) {
+      width = 2;
+    }
+    if (row_width + width > max_width) {
+      return i;
+    }
+    row_add_char(wc, width, attr, pair);
+    i += length;
+  }
+  return size;
+}
+
+uint64_t line_char(const LineMeta& line_meta, uint64_t i, uint64_t col, wchar_t& wc,
+                   int& width) {
+  // the character at byte i of a line, returning its length in bytes;
+  // width is the columns it takes at col, drawn by row_add_char()
+  uint8_t c = line_meta.at(i);
+  uint64_t length = 1;
+  wc = c;
+  width = 1;
+  if (c >= 0x80) {
+    uint8_t bytes[MB_LEN_MAX];
+    uint64_t n = std::min((uint64_t)MB_LEN_MAX, line_meta.size - i);
+    line_meta.copy_out(bytes, i, i + n);
+    mbstate_t state = mbstate_t();
+    size_t r = mbrtowc(&wc, (const char*)bytes, n, &state);
+    if (r == (size_t)-1 || r == (size_t)-2 || r == 0) {
+      wc = 0xfffd;  // replacement character
+    } else {
+      length = r;
+    }
+    width = wcwidth(wc);
+    if (width < 0) {
+      wc = 0xfffd;
+      width = 1;
+    }
+  }
+  if (wc == '\t') {
+    width = TABSIZE - col % TABSIZE;
+  } else if (wc < ' ' || wc == 0x7f) {
+    width = 2;
+  }
+  return length;
+}
+
+// what is highlighted on a line being drawn; a long line's is kept in a
+// slot of its own until the line is damaged, since highlighting it again
+// every frame it is scrolled through would be slow
+struct LineHighlight {
+  int64_t line = -1;
+  std::vector<HighlightSpan> spans;
+  std::vector<MatchIndex::Match> matches;
+};
+const uint64_t HIGHLIGHT_KEEP_SIZE = 64 * 1024;
+LineHighlight highlights[2];  // for short lines, and long ones
+
+void row_show(int y) {
+  mvadd_wchnstr(y, 0, row_cells.data(), row_cells.size());
+}
+
+const uint64_t LEX_SYNC_LINES = 200;  // how far back to look for a known state
+const int LEX_BUDGET = 5000;          // lines lex_update() re-lexes per frame
+std::vector<uint8_t> lex_copy;
+
+uint8_t lex_line(uint64_t line, uint8_t state, std::vector<HighlightSpan>* spans) {
+  LineMeta line_meta = file_lines[line];
+  const char* text = line_text(line_meta, lex_copy);
+  return syntax->lex((const uint8_t*)text, line_meta.size, state, spans);
+}
+
+uint8_t lex_start_state(uint64_t line) {
+  // the state line starts in, which is the end state of the line before;
+  // unlexed lines before it are lexed first, but no more than
+  // LEX_SYNC_LINES of them, so a jump into the middle of a file doesn't
+  // lex from the top: past that the first one is assumed to start afresh
+  uint64_t from = line;
+  while (from > 0 && line - from < LEX_SYNC_LINES &&
+         file_lines.lex_state(from - 1) == LineTree::LEX_UNKNOWN) {
+    from--;
+  }
+  uint8_t state = 0;
+  if (from > 0 && file_lines.lex_state(from - 1) != LineTree::LEX_UNKNOWN) {
+    state = file_lines.lex_state(from - 1);
+  }
+  for (; from < line; from++) {
+    state = lex_line(from, state, nullptr);
+    file_lines.set_lex_state(from, state);
+  }
+  return state;
+}
+
+void lex_window(uint64_t& from, uint64_t& to) {
+  // dirty lines in [from, to) are worth re-lexing now: the ones on screen
+  // and the ones a sync from the top of the screen would reach
+  from = (uint64_t)first_line > LEX_SYNC_LINES ? first_line - LEX_SYNC_LINES : 0;
+  to = std::min((uint64_t)first_line + LINES - 2, file_lines.size());
+}
+
+bool lex_pending() {
+  if (!syntax) {
+    return false;
+  }
+  uint64_t from, to;
+  lex_window(from, to);
+  auto it = std::lower_bound(lex_dirty.begin(), lex_dirty.end(), from);
+  return it != lex_dirty.end() && *it < to;
+}
+
+void lex_update() {
+  // re-lex dirty lines near the screen, each one and then the lines after
+  // it until one ends in the state it did before; the rest of the work, if
+  // LEX_BUDGET runs out, is left for the next frame
+  if (!syntax) {
+    return;
+  }
+  uint64_t from, to;
+  lex_window(from, to);
+  int budget = LEX_BUDGET;
+  size_t d = std::lower_bound(lex_dirty.begin(), lex_dirty.end(), from) - lex_dirty.begin();
+  while (d < lex_dirty.size() && lex_dirty[d] < to && budget > 0) {
+    uint64_t line = lex_dirty[d];
+    uint8_t state = lex_start_state(line);
+    uint8_t old;
+    bool next_dirty;
+    do {
+      old = file_lines.lex_state(line);
+      state = lex_line(line, state, nullptr);
+      file_lines.set_lex_state(line, state);
+      damage_line(line);  // it may start in a different state too
+      line++;
+      budget--;
+      next_dirty = (d + 1 < lex_dirty.size() && lex_dirty[d + 1] == line);
+    } while (state != old && line < to && budget > 0 && !next_dirty);
+    if (state == old || line >= file_lines.size() || next_dirty) {
+      lex_dirty.erase(lex_dirty.begin() + d);
+    } else {
+      lex_dirty[d++] = line;
+    }
+  }
+}
+
+uint64_t trimmed_bytes = 0;  // index_bytes() after the last trim
+
+void large_file_trim() {
+  // over budget, lines away from the screen go back to sparse runs
+  const uint64_t MARGIN = 4096;  // lines either side that stay indexed
+  uint64_t budget = memory_budget / 4;
+  if (!large_file || LineTree::index_bytes() <= std::max(budget, trimmed_bytes + budget / 8)) {
+    return;
+  }
+  uint64_t from = (uint64_t)first_line > MARGIN ? first_line - MARGIN : 0;
+  file_lines.sparsify(from, first_line + LINES + MARGIN, fileBuffer, fileBuffer + fileSize);
+  trimmed_bytes = LineTree::index_bytes();
+}
+
+int view_width() {
+  // the columns a line's text has on screen
+  return std::max(COLS - left_margin, 2);
+}
+
+LineMeta view_line(uint64_t line) {
+  file_lines.materialize(line, line + 1);
+  return file_lines[line];
+}
+
+Layout& line_layout(uint64_t line, uint64_t byte, uint64_t rows) {
+  // line's layout, walked until it has more than rows rows, or one that
+  // starts past byte, or it reaches the end of the line
+  assert(line < file_lines.size());
+  int width = soft_wrap ? view_width() : LAYOUT_STRIDE;
+  Layout& layout = layouts[line];
+  if (layout.width != width) {
+    layout = Layout();
+    layout.width = width;
+    layout.starts.push_back(0);
+    layout.cols.push_back(0);
+  }
+  if (layout.done || layout.starts.size() > rows || layout.starts.back() > byte) {
+    return layout;
+  }
+  LineMeta line_meta = view_line(line);
+  if (!line_meta.has_edit_buffer()) {
+    file_touch(line_meta.start);
+  }
+  while (layout.pos < line_meta.size && layout.starts.size() <= rows &&
+         layout.starts.back() <= byte) {
+    // plain ASCII goes a column a byte, up to the end of the row
+    bool front = layout.pos < line_meta.front_size();
+    const uint8_t* p = front ? line_meta.front() + layout.pos
+                             : line_meta.back() + layout.pos - line_meta.front_size();
+    uint64_t limit = (front ? line_meta.front_size() : line_meta.size) - layout.pos;
+    uint64_t row_end = soft_wrap ? width : layout.cols.back() + LAYOUT_STRIDE;
+    limit = std::min(limit, row_end > layout.pos_col ? row_end - layout.pos_col : 0);
+    uint64_t n = 0;
+    while (n < limit && p[n] >= ' ' && p[n] < 0x7f) {
+      n++;
+    }
+    if (n) {
+      layout.pos += n;
+      layout.pos_col += n;
+      continue;
+    }
+
+    wchar_t wc;
+    int w;
+    uint64_t length = line_char(line_meta, layout.pos, layout.pos_col, wc, w);
+    if (soft_wrap && layout.pos_col + w > (uint64_t)width && layout.pos > layout.starts.back()) {
+      // doesn't fit, so it starts the next row (and is measured again there)
+      layout.starts.push_back(layout.pos);
+      layout.cols.push_back(0);
+      layout.pos_col = 0;
+      continue;
+    }
+    if (!soft_wrap && w > 0 && layout.pos_col >= layout.cols.back() + LAYOUT_STRIDE) {
+      layout.starts.push_back(layout.pos);
+      layout.cols.push_back(layout.pos_col);
+    }
+    layout.pos += length;
+    layout.pos_col += w;
+  }
+  layout.done = layout.pos >= line_meta.size;
+  return layout;
+}
+
+void layout_trim() {
+  // once there are too many, drop the layouts of lines away from the screen
+  if (layouts.size() <= LAYOUT_MAX_LINES) {
+    return;
+  }
+  uint64_t from = first_line > LINES ? first_line - LINES : 0;
+  layouts.erase(layouts.begin(), layouts.lower_bound(from));
+  layouts.erase(layouts.lower_bound(first_line + 2 * LINES), layouts.end());
+}
+
+int line_rows(uint64_t line) {
+  // how many screen rows line takes, which means walking all of it
+  return soft_wrap ? line_layout(line, UINT64_MAX, UINT64_MAX).starts.size() : 1;
+}
+
+bool next_row(int& line, int& row) {
+  // step down a screen row; false on the last row of the file
+  if (soft_wrap && line_layout(line, UINT64_MAX, row + 1).starts.size() > (size_t)row + 1) {
+    row++;
+    return true;
+  }
+  if (line + 1 >= (int)file_lines.size()) {
+    return false;
+  }
+  line++;
+  row = 0;
+  return true;
+}
+
+bool prev_row(int& line, int& row) {
+  // step up a screen row; false on the first row of the file
+  if (row > 0) {
+    row--;
+    return true;
+  }
+  if (line <= 0) {
+    return false;
+  }
+  line--;
+  row = line_rows(line) - 1;
+  return true;
+}
+
+uint64_t byte_to_col(uint64_t line, uint64_t byte, int& row) {
+  // the row of line that byte is on, returning its column: from the start
+  // of the row with soft wrap, from the start of the line without
+  LineMeta line_meta = view_line(line);
+  Layout& layout = line_layout(line, byte, UINT64_MAX);
+  row = std::upper_bound(layout.starts.begin(), layout.starts.end(), byte) - layout.starts.begin() - 1;
+  uint64_t pos = layout.starts[row];
+  uint64_t col = layout.cols[row];
+  while (pos < byte && pos < line_meta.size) {
+    wchar_t wc;
+    int w;
+    pos += line_char(line_meta, pos, col, wc, w);
+    col += w;
+  }
+  if (!soft_wrap) {
+    row = 0;
+  }
+  return col + (byte > pos ? byte - pos : 0);
+}
+
+uint64_t col_to_byte(uint64_t line, int row, uint64_t col) {
+  // the byte of the character at col on a row of line, counting columns
+  // like byte_to_col(); past the end of a wrapped row is its last one
+  LineMeta line_meta = view_line(line);
+  Layout& layout = line_layout(line, UINT64_MAX, soft_wrap ? row + 1 : col / LAYOUT_STRIDE + 1);
+  size_t k = soft_wrap ? std::min((size_t)row, layout.starts.size() - 1)
+                       : std::upper_bound(layout.cols.begin(), layout.cols.end(), col) - layout.cols.begin() - 1;
+  bool wrapped = k + 1 < layout.starts.size() && soft_wrap;
+  uint64_t end = k + 1 < layout.starts.size() ? layout.starts[k + 1] : line_meta.size;
+  uint64_t pos = layout.starts[k];
+  uint64_t c = layout.cols[k];
+  uint64_t last = pos;
+  while (pos < end) {
+    wchar_t wc;
+    int w;
+    uint64_t length = line_char(line_meta, pos, c, wc, w);
+    if (c + w > col) {
+      break;
+    }
+    last = pos;
+    pos += length;
+    c += w;
+  }
+  return (wrapped && pos == end) ? last : pos;
+}
+
+int line_num_digits() {
+  // for the last line number on screen
+  int digits = 0;
+  for (int k = LINES - 3 + first_line; k > 0; k /= 10) {
+    digits++;
+  }
+  return digits;
+}
+
+void display_file() {
+  int rows = LINES - 2;
+  int line_num_length = line_num_digits();
+  left_margin = line_num_length + 1;
+
+  // the rows on screen, from the top down; an edit may have left the top
+  // row past the end of its line
+  layout_trim();
+  if (!soft_wrap) {
+    first_row = 0;
+  } else if (first_line < (int)file_lines.size()) {
+    Layout& layout = line_layout(first_line, UINT64_MAX, first_row);
+    first_row = std::min(first_row, (int)layout.starts.size() - 1);
+  }
+  std::vector<ScreenRow> screen_rows;
+  ScreenRow at = { first_line, first_row };
+  for (int i = 0; i < rows; i++) {
+    screen_rows.push_back(at);
+    if (at.line >= (int)file_lines.size() || !next_row(at.line, at.row)) {
+      at.line++;
+      at.row = 0;
+    }
+  }
+
+  // work out what has to be redrawn besides what the edits damaged; this
+  // doesn't damage the lines, so a long one keeps its highlighting
+  bool redraw = false;
+  if (left_margin != drawn_left_margin || LINES != drawn_lines || COLS != drawn_cols ||
+      first_col != drawn_first_col || (int)drawn_rows.size() != rows) {
+    redraw = true;
+  } else if (!(screen_rows[0] == drawn_rows[0])) {
+    // shift what is already on screen and only draw the rows that scrolled
+    // into view; with idlok the terminal does the shifting itself
+    int scrolled = 0;
+    for (int k = 1; k < rows && !scrolled; k++) {
+      if (screen_rows[0] == drawn_rows[k]) {
+        scrolled = k;
+      } else if (drawn_rows[0] == screen_rows[k]) {
+        scrolled = -k;
+      }
+    }
+    if (scrolled) {
+      setscrreg(0, rows - 1);
+      scrollok(stdscr, TRUE);
+      scrl(scrolled);
+      scrollok(stdscr, FALSE);
+      setscrreg(0, LINES - 1);
+      ScreenRow exposed = { -1, -1 };
+      if (scrolled > 0) {
+        drawn_rows.erase(drawn_rows.begin(), drawn_rows.begin() + scrolled);
+        drawn_rows.insert(drawn_rows.end(), scrolled, exposed);
+      } else {
+        drawn_rows.insert(drawn_rows.begin(), -scrolled, exposed);
+        drawn_rows.resize(rows);
+      }
+    } else {
+      redraw = true;
+    }
+  }
+  if (cy != drawn_cy) {
+    // the shaded cursor line moved
+    damage_line(drawn_cy);
+    damage_line(cy);
+  }
+
+  // file contents
+  lex_update();
+  rows_repainted = 0;
+
+  file_lines.materialize(first_line, screen_rows.back().line + 1);
+  int width = view_width();
+  for (LineHighlight& highlight : highlights) {
+    if (highlight.line >= 0 && line_damaged(highlight.line)) {
+      highlight.line = -1;
+    }
+  }
+  for (int i = 0; i < rows; i++) {
+    at = screen_rows[i];
+    if (!redraw && !line_damaged(at.line) && at == drawn_rows[i]) {
+      continue;
+    }
+    rows_repainted++;
+
+    row_clear();
+    if (at.line >= (int)file_lines.size()) {
+      row_fill(COLS, A_NORMAL, 0);
+      row_show(i);
+      continue;
+    }
+
+    short color_pair = COLOR_PAIR_LINENUM;
+    short text_pair = 0;
+    if (at.line == cy) {
+      color_pair = COLOR_PAIR_LINENUM_SHADED;
+      text_pair = COLOR_PAIR_LINE_SHADED;
+    }
+    char line_num_text[24];
+    snprintf(line_num_text, sizeof(line_num_text), "%*d ", line_num_length, at.line + 1);
+    for (char* cp = line_num_text; *cp; cp++) {
+      row_add(at.row == 0 ? *cp : ' ', 1, A_NORMAL, color_pair);
+    }
+
+    // highlighting, once for all the rows of a line; a line lexed for the
+    // first time keeps its end state
+    LineMeta line_meta = file_lines[at.line];
+    if (!line_meta.has_edit_buffer()) {
+      file_touch(line_meta.start);
+    }
+    LineHighlight& highlight = highlights[line_meta.size >= HIGHLIGHT_KEEP_SIZE];
+    const std::vector<HighlightSpan>& line_spans = highlight.spans;
+    const std::vector<MatchIndex::Match>& line_matches = highlight.matches;
+    if (at.line != highlight.line) {
+      highlight.line = at.line;
+      highlight.spans.clear();
+      if (syntax) {
+        uint8_t end_state = lex_line(at.line, lex_start_state(at.line), &highlight.spans);
+        if (file_lines.lex_state(at.line) == LineTree::LEX_UNKNOWN) {
+          file_lines.set_lex_state(at.line, end_state);
+        }
+      }
+
+      // the find dialog's match stands out, or else the regex search's
+      highlight.matches.clear();
+      if (at.line == find_match_line) {
+        MatchIndex::Match m = { (uint64_t)at.line, (uint32_t)find_match_col, (uint32_t)find_match_size };
+        highlight.matches.push_back(m);
+      } else {
+        search_matches.on_line(at.line, highlight.matches);
+      }
+    }
+    short syntax_pair = (at.line == cy) ? COLOR_PAIR_SYNTAX_SHADED : COLOR_PAIR_SYNTAX;
+    attr_t match_attr = (at.line == find_match_line) ? A_REVERSE : A_UNDERLINE | A_BOLD;
+
+    // the stretch of the line this row shows: a wrapped row, or the
+    // columns from first_col on, walked from the checkpoint before it
+    Layout& layout = soft_wrap ? line_layout(at.line, UINT64_MAX, at.row + 1)
+                               : line_layout(at.line, UINT64_MAX, first_col / LAYOUT_STRIDE + 1);
+    size_t k = soft_wrap ? at.row
+                         : std::upper_bound(layout.cols.begin(), layout.cols.end(), first_col) - layout.cols.begin() - 1;
+    uint64_t pos = layout.starts[k];
+    uint64_t col = layout.cols[k];
+    uint64_t end = (soft_wrap && k + 1 < layout.starts.size()) ? layout.starts[k + 1] : line_meta.size;
+    uint64_t left = soft_wrap ? 0 : first_col;
+    size_t s = std::partition_point(line_spans.begin(), line_spans.end(),
+        [pos](const HighlightSpan& span) { return span.to <= pos; }) - line_spans.begin();
+    size_t m = std::partition_point(line_matches.begin(), line_matches.end(),
+        [pos](const MatchIndex::Match& match) { return match.col + match.size <= pos; }) - line_matches.begin();
+    while (pos < end) {
+      wchar_t wc;
+      int w;
+      uint64_t length = line_char(line_meta, pos, col, wc, w);
+      if (col + w > left + width) {
+        break;  // the row is full
+      }
+      if (col >= left && (w > 0 || row_width > left_margin)) {
+        while (s < line_spans.size() && line_spans[s].to <= pos) {
+          s++;
+        }
+        while (m < line_matches.size() && line_matches[m].col + line_matches[m].size <= pos) {
+          m++;
+        }
+        short pair = text_pair;
+        attr_t attr = A_NORMAL;
+        if (s < line_spans.size() && line_spans[s].from <= pos) {
+          pair = syntax_pair + line_spans[s].kind;
+        }
+        if (m < line_matches.size() && line_matches[m].col <= pos) {
+          attr = match_attr;
+        }
+        row_add_char(wc, w, attr, pair);
+      } else if (col + w > left) {
+        // straddles the left edge: the part in view shows blank
+        row_fill(row_width + (col + w - left), A_NORMAL, text_pair);
+      }
+      pos += length;
+      col += w;
+    }
+    if (!soft_wrap && pos < line_meta.size) {
+      // doesn't fit: make room for a '$' in the last column
+      while (row_width > COLS - 1) {
+        wchar_t wstr[CCHARW_MAX + 1];
+        attr_t attr;
+        short pair;
+        getcchar(&row_cells.back(), wstr, &attr, &pair, nullptr);
+        row_width -= std::max(1, wcwidth(wstr[0]));
+        row_cells.pop_back();
+      }
+      row_add('$', 1, A_REVERSE, text_pair);
+    }
+    row_fill(COLS, A_NORMAL, text_pair);
+    row_show(i);
+  }
+
+  rows_repainted_total += rows_repainted;
+  damaged_lines.clear();
+  damaged_from = UINT64_MAX;
+  drawn_rows = screen_rows;
+  drawn_first_col = first_col;
+  drawn_cy = cy;
+  drawn_left_margin = left_margin;
+  drawn_lines = LINES;
+  drawn_cols = COLS;
+}
+
+void render_status() {
+  std::string status = filePath.size() ? filePath : "(new file)";
+  if (dirty) {
+    status += '*';
+  }
+  char text[128];
+  snprintf(text, sizeof(text), " (%d:%d) ", cy + 1, cx + 1);
+  status += text;
+  if (cy < (int)file_lines.size()) {
+    // until the index is done the file's size stands in for the total
+    uint64_t offset = file_lines.byte_offset(cy, fileBuffer + fileSize) + cx;
+    uint64_t bytes = index_busy() ? fileSize : file_lines.byte_count(fileBuffer + fileSize);
+    snprintf(text, sizeof(text), "@%llu %d%% ", (unsigned long long)offset,
+             (int)(std::min(offset, bytes) * 100 / std::max(bytes, (uint64_t)1)));
+    status += text;
+  }
+  if (index_busy()) {
+    snprintf(text, sizeof(text), "indexing\xe2\x80\xa6 %llu lines / %d%% ",
+             (unsigned long long)file_lines.size(), (int)(index_bytes_done * 100 / fileSize));
+    status += text;
+  }
+  if (search_active) {
+    snprintf(text, sizeof(text), "%llu matches%s ", (unsigned long long)search_matches.size(),
+             search_busy() ? "\xe2\x80\xa6" : "");
+    status += text;
+  }
+  if (save_busy()) {
+    snprintf(text, sizeof(text), "saving\xe2\x80\xa6 %d%% ",
+             (int)(save_written * 100 / std::max(save_size.load(), (uint64_t)1)));
+    status += text;
+  }
+  // hirogana 'aiueo'
+  status += "\xe3\x81\x82\xe3\x81\x84\xe3\x81\x86\xe3\x81\x88\xe3\x81\x8a";
+  // smile
+  status += "\xf0\x9f\x98\x80";
+
+  row_clear();
+  mbstate_t state = mbstate_t();
+  row_add_text((const uint8_t*)status.data(), status.size(), A_REVERSE, 0, COLS, state);
+  row_fill(COLS, A_REVERSE, 0);
+  row_show(LINES - 2);
+}
+
+void render_stats() {
+  printw("Repainted %d rows (%llu total) | Edit buffers: %llu KiB live, %llu KiB wasted, %llu slabs"
+         " | Undo: %llu steps, %llu KiB | Index: %llu KiB",
+         rows_repainted, (unsigned long long)rows_repainted_total,
+         (unsigned long long)(EditArena::small_live + EditArena::large_live) / 1024,
+         (unsigned long long)(EditArena::slab_bytes - EditArena::small_live) / 1024,
+         (unsigned long long)EditArena::slabs,
+         (unsigned long long)undo_log.size(), (unsigned long long)undo_memory / 1024,
+         (unsigned long long)(LineTree::index_bytes() / 1024));
+}
+
+void render_cl() {
+  assert(cl_message_level >= 0 && cl_message_level <= 1);
+
+  move(LINES - 1, 0);
+  clrtoeol();
+  time_t now = time(nullptr);
+  if (difftime(now, cl_message_time) > 5.0) {
+    if (stats_visible) {
+      render_stats();
+    }
+    return;
+  }
+  if (cl_message_level == 1) {
+    attron(COLOR_PAIR(COLOR_PAIR_ERROR));
+  }
+  printw(cl_message.c_str());
+  attroff(COLOR_PAIR(COLOR_PAIR_ERROR));
+}
+
+void index_cache_recount(uint64_t from, uint64_t to) {
+  // the runs a cache gave are checked as they come to be needed (see
+  // LineTree::recount()).  One that was wrong is as if its lines had been
+  // taken out and the right ones put in, and the cache is out of date
+  std::vector<LineTree::Recount> fixed;
+  if (!file_lines.recount(from, to, fixed)) {
+    return;
+  }
+  for (const LineTree::Recount& run : fixed) {
+    int64_t delta = (int64_t)run.now - (int64_t)run.was;
+    search_edit(run.line, -(int64_t)run.was);
+    search_edit(run.line, run.now);
+    lex_edit(run.line, -(int64_t)run.was);
+    lex_edit(run.line, run.now);
+    layout_edit(run.line, -(int64_t)run.was);
+    layout_edit(run.line, run.now);
+    damage_from(run.line);
+    if (cy >= (int64_t)(run.line + run.was)) {
+      cy += delta;
+    } else if (cy >= (int64_t)(run.line + run.now)) {
+      cy = run.line + run.now - 1;
+    }
+    if (first_line >= (int64_t)(run.line + run.was)) {
+      first_line += delta;
+    }
+  }
+  cx = std::min((uint64_t)cx, file_lines[cy].size);
+  if (index_cache_file.size()) {
+    unlink(index_cache_file.c_str());
+    index_cache_file.clear();
+  }
+  printcl(1, "The line index cache was out of date; re-indexed %llu runs of lines",
+          (unsigned long long)fixed.size());
+}
+
+void update_screen() {
+  // what is about to be drawn has to be counted right first
+  index_cache_recount(first_line, first_line + LINES);
+  index_cache_recount(cy, cy + 1);
+  display_file();
+  render_status();
+  render_cl();
+  refresh();
+}
+
+void regenerate_screen() {
+  window_resized = false;
+  endwin();
+  damage_all();
+
+  update_screen();
+}
+
+void index_poll() {
+  // take whatever the background indexer has finished so far
+  if (!index_busy()) {
+    return;
+  }
+  bool finished;
+  {
+    std::lock_guard<std::mutex> lock(index_mutex);
+    damage_from(file_lines.size());
+    for (const LineRun& run : index_pending_runs) {
+      file_lines.append_run(run.start, run.end, run.lines);
+    }
+    index_pending_runs.clear();
+    file_lines.append(index_pending.data(), index_pending.data() + index_pending.size(),
+                      fileBuffer + fileSize);
+    index_pending.clear();
+    finished = !index_running;
+  }
+  if (finished) {
+    index_thread.join();
+    if (!index_cancel) {
+      index_cache_save();
+    }
+    printcl(0, "Indexed %llu lines in %.1f ms (%u threads)",
+            (unsigned long long)file_lines.size(), index_time_ms, index_threads_used);
+  }
+}
+
+void index_wait_for(uint64_t lines) {
+  // block until at least `lines` lines are known, or the whole file is
+  while (index_busy() && file_lines.size() < lines) {
+    {
+      std::unique_lock<std::mutex> lock(index_mutex);
+      index_cond.wait_for(lock, std::chrono::milliseconds(100));
+    }
+    index_poll();
+    render_status();
+    refresh();
+  }
+}
+
+void index_stop() {
+  if (index_busy()) {
+    index_cancel = true;
+    index_thread.join();
+  }
+}
+
+void search_replay(std::vector<MatchIndex::Match>& matches) {
+  // bring a block from the snapshot up to date with search_journal.  Most
+  // edits land wholly before or after a block, so those only add up to a
+  // shift for the lot; only edits inside it look at every match.
+  int64_t offset = 0;
+  for (const SearchEdit& edit : search_journal) {
+    if (matches.empty()) {
+      return;
+    }
+    uint64_t first = matches.front().line + offset;
+    uint64_t last = matches.back().line + offset;
+    if (edit.line > last) {
+      continue;
+    }
+    if (edit.delta != 0 && edit.line + std::max(-edit.delta, (int64_t)0) <= first) {
+      offset += edit.delta;
+      continue;
+    }
+    size_t kept = 0;
+    for (MatchIndex::Match m : matches) {
+      m.line += offset;
+      if (edit.delta == 0) {
+        if (m.line == edit.line) {
+          continue;
+        }
+      } else if (m.line >= edit.line) {
+        if (edit.delta < 0 && m.line < edit.line - edit.delta) {
+          continue;  // the line was taken out
+        }
+        m.line += edit.delta;
+      }
+      matches[kept++] = m;
+    }
+    matches.resize(kept);
+    offset = 0;
+  }
+  for (MatchIndex::Match& m : matches) {
+    m.line += offset;
+  }
+}
+
+void search_poll() {
+  // add the blocks the search threads have finished so far, renumbered
+  // for the edits made since they were searched
+  if (!search_busy()) {
+    return;
+  }
+  std::vector<std::vector<MatchIndex::Match>> blocks;
+  bool finished;
+  {
+    std::lock_guard<std::mutex> lock(search_mutex);
+    blocks.swap(search_pending);
+    finished = (search_running == 0);
+  }
+  int64_t last_row = first_line + LINES - 2;
+  for (std::vector<MatchIndex::Match>& matches : blocks) {
+    search_replay(matches);
+    for (const MatchIndex::Match& m : matches) {
+      if ((int64_t)m.line >= first_line && (int64_t)m.line < last_row) {
+        damage_line(m.line);
+      }
+    }
+    search_matches.insert(matches);
+  }
+  if (finished) {
+    for (std::thread& thread : search_threads) {
+      thread.join();
+    }
+    std::chrono::duration<double, std::milli> search_time = std::chrono::steady_clock::now() - search_begin;
+    printcl(0, "%llu matches in %.1f ms (%u threads)", (unsigned long long)search_matches.size(),
+            search_time.count(), (unsigned int)search_threads.size());
+    search_threads.clear();
+    delete search_snapshot;
+    search_snapshot = nullptr;
+    search_journal.clear();
+  }
+}
+
+void search_stop() {
+  // stop the search threads and forget the matches
+  if (search_busy()) {
+    search_cancel = true;
+    for (std::thread& thread : search_threads) {
+      thread.join();
+    }
+    search_threads.clear();
+    delete search_snapshot;
+    search_snapshot = nullptr;
+    search_pending.clear();
+    search_journal.clear();
+  }
+  if (search_active) {
+    regfree(&search_regex);
+    search_active = false;
+  }
+  search_matches.clear();
+  damage_all();
+}
+
+bool search_start(const std::string& pattern) {
+  search_stop();
+  int err = regcomp(&search_regex, pattern.c_str(), SEARCH_FLAGS);
+  if (err) {
+    char message[256];
+    regerror(err, &search_regex, message, sizeof(message));
+    printcl(1, "Bad regex: %s", message);
+    return false;
+  }
+  index_wait_for(UINT64_MAX);
+  index_cache_recount(0, file_lines.size());  // it reads the lot anyway
+  search_active = true;
+  search_pattern = pattern;
+  search_begin = std::chrono::steady_clock::now();
+  search_snapshot = file_lines.snapshot();
+  search_cancel = false;
+  search_next_block = 0;
+  search_lines_done = 0;
+  search_running = index_threads;
+  for (unsigned int i = 0; i < index_threads; i++) {
+    search_threads.push_back(std::thread(search_worker, pattern));
+  }
+  return true;
+}
+
+// Replace all: one pass over the file, split into blocks of lines shared out
+// among threads like the regex search.  Only lines with a match are
+// rewritten, each straight into a new edit buffer of its own, and the lot
+// go into file_lines with one replace_lines(), which is one step to undo.
+struct ReplaceBlock {
+  std::vector<uint64_t> numbers;
+  std::vector<LineMeta> lines;
+  uint64_t replaced = 0;  // matches
+};
+std::atomic<uint64_t> replace_lines_done(0);
+std::atomic<bool> replace_cancel(false);
+
+int replacement_groups(const std::string& replacement) {
+  // how many of the match's groups the replacement needs, counting the
+  // whole match as group 0; glibc is a good deal faster when asked for none
+  int groups = 1;
+  for (size_t i = 0; i + 1 < replacement.size(); i++) {
+    if (replacement[i] == '\\') {
+      char c = replacement[++i];
+      if (c >= '0' && c <= '9') {
+        groups = std::max(groups, c - '0' + 1);
+      }
     }
-    attron(COLOR_PAIR(color_pair));
-    printw("%*d", line_num_length, line_num + 1);
-    addch(' ');
-    attroff(COLOR_PAIR(color_pair));
+  }
+  return groups;
+}
 
-    LineMeta& line_meta = file_lines[line_num];
-    int chars_to_put = line_meta.size;
-    bool char_overflow = false;
-    if (chars_to_put > cols) {
-      chars_to_put = cols - 1;
-      char_overflow = true;
+uint64_t replace_line(const regex_t* regex, const char* text, uint64_t size,
+                      const std::string& replacement, int groups, std::string& out) {
+  // write text with every match replaced to out, returning the number of
+  // matches; \0 to \9 in replacement stand for the match and its groups
+  const int MAX_GROUPS = 10;
+  assert(groups >= 1 && groups <= MAX_GROUPS);
+  uint64_t from = 0, copied = 0, replaced = 0;
+  int64_t last_end = -1;
+  while (from <= size) {
+    regmatch_t m[MAX_GROUPS];
+    m[0].rm_so = from;
+    m[0].rm_eo = size;
+    if (regexec(regex, text, groups, m, REG_STARTEND) != 0) {
+      break;
     }
-    if (line_num == cy) {
-      attron(COLOR_PAIR(COLOR_PAIR_LINE_SHADED));
+    from = std::max((uint64_t)m[0].rm_eo, (uint64_t)m[0].rm_so + 1);
+    if (m[0].rm_so == m[0].rm_eo && m[0].rm_so == last_end) {
+      continue;  // an empty match right after the last one
     }
-    for (int j = 0; j < chars_to_put; j++) {
-      addch(line_meta.start[j]);
+    if (replaced == 0) {
+      out.clear();
     }
-
-    if (char_overflow) {
-      attron(A_REVERSE);
-      addch('$');
-      attroff(A_REVERSE);
+    out.append(text + copied, m[0].rm_so - copied);
+    for (size_t i = 0; i < replacement.size(); i++) {
+      char c = replacement[i];
+      if (c == '\\' && i + 1 < replacement.size()) {
+        c = replacement[++i];
+        if (c >= '0' && c <= '9') {
+          const regmatch_t& group = m[c - '0'];
+          if (group.rm_so >= 0) {
+            out.append(text + group.rm_so, group.rm_eo - group.rm_so);
+          }
+          continue;
+        }
+      }
+      out += c;
     }
+    copied = last_end = m[0].rm_eo;
+    replaced++;
+  }
+  if (replaced) {
+    out.append(text + copied, size - copied);
+  }
+  return replaced;
+}
 
-    if (line_num == cy) {
-      int x, y;
-      getyx(stdscr, y, x);
-      for (; x < COLS; x++) {
-        addch(' ');
+void replace_worker(const LineTree* lines, std::string pattern, std::string replacement,
+                    std::atomic<uint64_t>* next_block, std::vector<ReplaceBlock>* blocks) {
+  const uint64_t REPLACE_BLOCK = 64 * 1024;
+  regex_t regex;
+  int err = regcomp(&regex, pattern.c_str(), SEARCH_FLAGS);
+  assert(err == 0);  // it compiled once already
+  (void)err;
+  std::vector<uint8_t> copy;
+  std::string out;
+  int groups = replacement_groups(replacement);
+  while (1) {
+    uint64_t first = next_block->fetch_add(REPLACE_BLOCK);
+    if (first >= lines->size()) {
+      break;
+    }
+    uint64_t last = std::min(first + REPLACE_BLOCK, lines->size());
+    ReplaceBlock& block = (*blocks)[first / REPLACE_BLOCK];
+    LineTree::iterator it = lines->begin(first);
+    const uint8_t* block_start = it.scanned_from();
+    for (; it.line() < last && !replace_cancel; ++it) {
+      const LineMeta& line_meta = *it;
+      uint64_t replaced = replace_line(&regex, line_text(line_meta, copy), line_meta.size,
+                                       replacement, groups, out);
+      if (replaced) {
+        block.numbers.push_back(it.line());
+        block.lines.push_back(LineMeta::copy_of((const uint8_t*)out.data(), out.size()));
+        block.replaced += replaced;
       }
-      attroff(COLOR_PAIR(COLOR_PAIR_LINE_SHADED));
     }
+    file_release(block_start, (it.line() < lines->size()) ? it->start : fileBuffer + fileSize);
+    replace_lines_done += last - first;
   }
+  regfree(&regex);
 }
 
-void render_status() {
-  move(LINES - 2, 0);
-  attron(A_REVERSE);
-  if (filePath.size()) {
-    printw(filePath.c_str());
-  } else {
-    printw("(new file)");
-  }
-  if (dirty) {
-    addch('*');
+bool replace_all(const std::string& pattern, const std::string& replacement) {
+  const uint64_t REPLACE_BLOCK = 64 * 1024;  // as in replace_worker()
+  regex_t regex;
+  int err = regcomp(&regex, pattern.c_str(), SEARCH_FLAGS);
+  if (err) {
+    char message[256];
+    regerror(err, &regex, message, sizeof(message));
+    printcl(1, "Bad regex: %s", message);
+    return false;
   }
-  printw(" (%d:%d) ", cy + 1, cx + 1);
-  // hirogana 'aiueo'
-  printw("\xe3\x81\x82\xe3\x81\x84\xe3\x81\x86\xe3\x81\x88\xe3\x81\x8a");
-  // smile
-  printw("\xf0\x9f\x98\x80");
+  regfree(&regex);
+  index_wait_for(UINT64_MAX);
+  index_cache_recount(0, file_lines.size());
 
-  int x, y;
-  getyx(stdscr, y, x);
-  for (; x < COLS; x++) {
-    addch(' ');
+  // nothing edits file_lines until the workers are done, so they can all
+  // read it as it is
+  auto begin = std::chrono::steady_clock::now();
+  const LineTree* lines = &file_lines;
+  std::atomic<uint64_t> next_block(0);
+  std::vector<ReplaceBlock> blocks((lines->size() + REPLACE_BLOCK - 1) / REPLACE_BLOCK);
+  std::vector<std::thread> workers;
+  unsigned int threads = std::max(1u, std::min(index_threads, (unsigned int)blocks.size()));
+  replace_lines_done = 0;
+  replace_cancel = false;
+  for (unsigned int i = 0; i < threads; i++) {
+    workers.push_back(std::thread(replace_worker, lines, pattern, replacement, &next_block, &blocks));
   }
-  attroff(A_REVERSE);
-}
-
-void render_cl() {
-  assert(cl_message_level >= 0 && cl_message_level <= 1);
-
-  move(LINES - 1, 0);
-  clrtoeol();
-  time_t now = time(nullptr);
-  if (difftime(now, cl_message_time) > 5.0) {
-    return;
+  // keep the progress on screen until they're done; Esc cancels, and any
+  // other key (a resize too) is kept for when they are
+  std::vector<std::pair<int, MEVENT>> keys;
+  nodelay(stdscr, TRUE);
+  while (replace_lines_done < lines->size() && !replace_cancel) {
+    move(LINES - 1, 0);
+    clrtoeol();
+    printw("Replacing\xe2\x80\xa6 %d%% (esc to cancel)",
+           (int)(replace_lines_done * 100 / std::max(lines->size(), (uint64_t)1)));
+    refresh();
+    int c;
+    while ((c = wgetch(stdscr)) != ERR) {
+      MEVENT event = {};
+      if (c == 27) {
+        replace_cancel = true;
+      } else if (c != KEY_MOUSE || getmouse(&event) == OK) {
+        keys.push_back(std::make_pair(c, event));
+      }
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
   }
-  if (cl_message_level == 1) {
-    attron(COLOR_PAIR(COLOR_PAIR_ERROR));
+  nodelay(stdscr, FALSE);
+  if (window_resized) {
+    // the main loop only hears of it while it waits for a key
+    ungetch(KEY_RESIZE);
+  }
+  for (auto key = keys.rbegin(); key != keys.rend(); ++key) {
+    if (key->first == KEY_MOUSE) {
+      ungetmouse(&key->second);
+    } else {
+      ungetch(key->first);
+    }
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+  if (replace_cancel) {
+    for (ReplaceBlock& block : blocks) {
+      for (LineMeta& line_meta : block.lines) {
+        line_meta.release();
+      }
+    }
+    printcl(0, "Replace cancelled; nothing was changed");
+    return false;
   }
-  printw(cl_message.c_str());
-  attroff(COLOR_PAIR(COLOR_PAIR_ERROR));
-}
-
-void update_screen() {
-  display_file();
-  render_status();
-  render_cl();
-  refresh();
-}
-
-void regenerate_screen() {
-  window_resized = false;
-  endwin();
 
-  update_screen();
+  std::vector<uint64_t> numbers;
+  std::vector<LineMeta> replacements;
+  uint64_t replaced = 0;
+  for (ReplaceBlock& block : blocks) {
+    numbers.insert(numbers.end(), block.numbers.begin(), block.numbers.end());
+    replacements.insert(replacements.end(), block.lines.begin(), block.lines.end());
+    replaced += block.replaced;
+  }
+  blocks.clear();
+  replace_lines(numbers, replacements);
+  for (LineMeta& line_meta : replacements) {
+    line_meta.release();
+  }
+  std::chrono::duration<double, std::milli> replace_time = std::chrono::steady_clock::now() - begin;
+  printcl(0, "Replaced %llu matches on %llu lines in %.1f ms (%u threads)",
+          (unsigned long long)replaced, (unsigned long long)numbers.size(), replace_time.count(),
+          threads);
+  return true;
 }
 
 void scroll_file(int lines) {
+  if (soft_wrap) {
+    // by screen rows, stopping with the last one at the bottom
+    for (; lines < 0 && prev_row(first_line, first_row); lines++) {
+    }
+    if (lines > 0) {
+      int line = first_line, row = first_row, below = 0;
+      while (below < LINES - 3 + lines && next_row(line, row)) {
+        below++;
+      }
+      for (int n = below - (LINES - 3); n > 0; n--) {
+        next_row(first_line, first_row);
+      }
+    }
+    return;
+  }
   first_line += lines;
-  if (first_line < 0) first_line = 0;
   const int MAX_BLANK_LINES = 0;
   int clamp_first_line = file_lines.size() - LINES + 2 + MAX_BLANK_LINES;
   if (first_line > clamp_first_line) first_line = clamp_first_line;
+  if (first_line < 0) first_line = 0;
 }
 
 void screen_to_file(int y, int x, int& cy, int& cx) {
-  cy = y + first_line;
-  cx = x - left_margin;
+  // walks down from the top row, so it costs no more than a screenful
+  // however long the lines are
+  int line = first_line, row = first_row;
+  for (int i = 0; i < y && next_row(line, row); i++) {
+  }
+  uint64_t col = std::max(x - left_margin, 0);
+  if (!soft_wrap) {
+    col += first_col;
+  }
+  cy = line;
+  cx = col_to_byte(line, row, col);
 }
 
 void get_cursor(int& y, int& x) {
-  y = cy - first_line;
-  x = cx + left_margin;
+  int row;
+  uint64_t col = byte_to_col(cy, cx, row);
+  if (!soft_wrap) {
+    y = cy - first_line;
+    x = col - first_col + left_margin;
+    return;
+  }
+  // count rows down from the top, giving up past the bottom one
+  y = 0;
+  if (cy < first_line || (cy == first_line && row < first_row)) {
+    y = -1;
+  } else {
+    int line = first_line, r = first_row;
+    while ((line != cy || r != row) && y <= LINES - 3 && next_row(line, r)) {
+      y++;
+    }
+    if (line != cy || r != row) {
+      y = LINES;
+    }
+  }
+  x = std::min((int)col, view_width() - 1) + left_margin;
 }
 
 void set_cursor() {
@@ -376,20 +4789,225 @@ void set_cursor() {
   move(y, x);
 }
 
-void save(const std::string& savePath) {
-  FILE* saveFile = fopen(savePath.c_str(), "w");
-  bool first_line = true;
-  for (LineMeta& line_meta : file_lines) {
-    if (first_line) {
-      first_line = false;
+bool save_write(int fd, std::vector<iovec>& iov) {
+  // write out everything in iov, however short the writes come back, at
+  // most WRITE_CHUNK at a time so progress and cancelling keep up
+  const uint64_t WRITE_CHUNK = 16 * 1024 * 1024;
+  iovec* next = iov.data();
+  int count = iov.size();
+  while (count > 0) {
+    if (save_cancel) {
+      errno = ECANCELED;
+      return false;
+    }
+    int chunk_count = 0;
+    uint64_t chunk_size = 0;
+    while (chunk_count < std::min(count, IOV_MAX) && chunk_size < WRITE_CHUNK) {
+      chunk_size += next[chunk_count++].iov_len;
+    }
+    iovec& chunk_last = next[chunk_count - 1];
+    size_t last_len = chunk_last.iov_len;
+    if (chunk_size > WRITE_CHUNK) {
+      chunk_last.iov_len -= chunk_size - WRITE_CHUNK;
+    }
+    ssize_t n = writev(fd, next, chunk_count);
+    chunk_last.iov_len = last_len;
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    save_written += n;
+    while (count > 0 && (size_t)n >= next->iov_len) {
+      n -= next->iov_len;
+      next++;
+      count--;
+    }
+    if (count > 0) {
+      next->iov_base = (uint8_t*)next->iov_base + n;
+      next->iov_len -= n;
+    }
+  }
+  iov.clear();
+  return true;
+}
+
+void save_worker() {
+  auto save_begin = std::chrono::steady_clock::now();
+  const LineTree& lines = *save_snapshot;
+  save_error = 0;
+
+  // the size is only for showing progress, but it is cheap to add up,
+  // unless the file is too big to go over twice
+  uint64_t size = fileSize + 1;
+  if (!large_file) {
+    size = 0;
+    for (const LineMeta& line_meta : lines) {
+      size += line_meta.size + 1;
+    }
+  }
+  save_size = size - 1;
+
+  // the file is written next to the old one and renamed over it once it is
+  // safely on disk, so a failed save leaves the old file as it was (and
+  // the old file stays mapped for as long as we need it)
+  std::string path = save_path;
+  struct stat old_stat;
+  bool existed = (stat(path.c_str(), &old_stat) == 0);
+  char* real_path = realpath(path.c_str(), nullptr);
+  if (real_path) {
+    path = real_path;  // replace what a symlink points at, not the link
+    free(real_path);
+  }
+  std::string temp_path = path + ".XXXXXX";
+  int fd = mkstemp(&temp_path[0]);
+  if (fd < 0) {
+    save_error = errno;
+    save_running = false;
+    return;
+  }
+  if (existed) {
+    fchmod(fd, old_stat.st_mode & 07777);
+    if (fchown(fd, old_stat.st_uid, old_stat.st_gid)) {
+      // not allowed to give it away; it stays ours
+    }
+  } else {
+    mode_t mask = umask(0);
+    umask(mask);
+    fchmod(fd, 0666 & ~mask);
+  }
+
+  // lines the editor hasn't touched sit in the file buffer one after the
+  // other, so a run of them (with the line feeds between them) goes out as
+  // a single iovec
+  static const uint8_t newline = '\n';
+  const uint64_t IOV_BATCH = 1024;
+  std::vector<iovec> iov;
+  iov.reserve(IOV_BATCH + 3);
+  uint64_t lines_left = lines.size();
+  bool ok = true;
+  const uint8_t* written_from = nullptr;  // file pages written out since the last batch
+  for (const LineMeta& line_meta : lines) {
+    bool last = (--lines_left == 0);
+    if (line_meta.has_edit_buffer()) {
+      iov.push_back({ (void*)line_meta.front(), line_meta.front_size() });
+      iov.push_back({ (void*)line_meta.back(), line_meta.back_size() });
+      if (!last) {
+        iov.push_back({ (void*)&newline, 1 });
+      }
+    } else {
+      const uint8_t* end = line_meta.start + line_meta.size;
+      uint64_t size = line_meta.size;
+      if (!last && end >= fileBuffer && end < fileBuffer + fileSize && *end == '\n') {
+        size++;  // the line feed is already there after it
+      } else if (!last) {
+        iov.push_back({ (void*)line_meta.start, size });
+        size = 0;
+        iov.push_back({ (void*)&newline, 1 });
+      }
+      if (size > 0) {
+        iovec* prev = iov.empty() ? nullptr : &iov.back();
+        if (prev && (uint8_t*)prev->iov_base + prev->iov_len == line_meta.start) {
+          prev->iov_len += size;
+        } else {
+          iov.push_back({ (void*)line_meta.start, size });
+        }
+      }
+    }
+    if (!written_from && !line_meta.has_edit_buffer()) {
+      written_from = line_meta.start;
+    }
+    // in large-file mode a window's worth of the file goes out at a time,
+    // so its pages can be dropped behind
+    bool window_done = large_file && written_from && !line_meta.has_edit_buffer() &&
+                       line_meta.start - written_from >= (int64_t)FILE_WINDOW;
+    if (iov.size() >= IOV_BATCH || window_done) {
+      if (!(ok = save_write(fd, iov))) {
+        break;
+      }
+      if (written_from && !line_meta.has_edit_buffer()) {
+        file_release(written_from, line_meta.start);
+        written_from = nullptr;
+      }
+    }
+  }
+  ok = ok && save_write(fd, iov) && fsync(fd) == 0;
+  save_error = ok ? 0 : errno;
+  if (close(fd) != 0 && ok) {
+    save_error = errno;
+    ok = false;
+  }
+  if (ok && rename(temp_path.c_str(), path.c_str()) != 0) {
+    save_error = errno;
+    ok = false;
+  }
+  if (!ok) {
+    unlink(temp_path.c_str());
+    save_running = false;
+    return;
+  }
+
+  // make the rename itself stick
+  std::string dir = path.substr(0, path.find_last_of('/') + 1);
+  int dir_fd = open(dir.size() ? dir.c_str() : ".", O_RDONLY | O_DIRECTORY);
+  if (dir_fd >= 0) {
+    fsync(dir_fd);
+    close(dir_fd);
+  }
+
+  std::chrono::duration<double> save_time = std::chrono::steady_clock::now() - save_begin;
+  save_seconds = save_time.count();
+  save_running = false;
+}
+
+bool save(const std::string& savePath) {
+  // start saving in the background; save_poll() says how it went
+  if (save_busy()) {
+    printcl(1, "Still saving %s", save_path.c_str());
+    return false;
+  }
+  // everything has to be indexed before it can be written out
+  index_wait_for(UINT64_MAX);
+  index_cache_recount(0, file_lines.size());
+
+  save_snapshot = file_lines.snapshot();
+  save_generation = edit_generation;
+  save_path = savePath;
+  save_cancel = false;
+  save_size = 0;
+  save_written = 0;
+  save_running = true;
+  save_thread = std::thread(save_worker);
+  return true;
+}
+
+bool save_poll() {
+  // pick up a finished save; returns true if one finished
+  if (!save_busy() || save_running) {
+    return false;
+  }
+  save_thread.join();
+  uint64_t lines = save_snapshot->size();
+  delete save_snapshot;
+  save_snapshot = nullptr;
+
+  save_ok = (save_error == 0);
+  if (!save_ok) {
+    if (save_error == ECANCELED) {
+      printcl(1, "Save of %s cancelled", save_path.c_str());
     } else {
-      fputc('\n', saveFile);
+      printcl(1, "Can't save %s: %s", save_path.c_str(), strerror(save_error));
     }
-    fwrite(line_meta.start, 1, line_meta.size, saveFile);
+    return true;
   }
-  fclose(saveFile);
-  dirty = false;
-  beep();
+  printcl(0, "Saved %llu lines, %.1f MiB in %.2f s (%.0f MiB/s)",
+          (unsigned long long)lines, save_written / 1048576.0, save_seconds,
+          save_written / 1048576.0 / std::max(save_seconds, 1e-6));
+  if (edit_generation == save_generation) {
+    dirty = false;  // unless something changed while we were saving
+  }
+  return true;
 }
 
 void dialog_render(const std::string& prompt, const std::string& entry, const int cursor) {
@@ -446,163 +5064,909 @@ void dialog_keyinput(std::string& entry, int c, int& cursor, int input_mask=INPU
   }
 }
 
-void dialog_clear() {
-  move(LINES - 1, 0);
-  clrtoeol();
+void dialog_clear() {
+  move(LINES - 1, 0);
+  clrtoeol();
+}
+
+bool savedialog(std::string& savePath) {
+  std::string newSavePath = savePath;
+  int cx = savePath.size();
+
+  while (1) {
+    dialog_render("Filename: ", newSavePath, cx);
+    int c = wgetch(stdscr);
+
+    if (c == 27) {
+      dialog_clear();
+      return false;
+    } else if (c == '\r' || c == '\n' || c == KEY_ENTER) {
+      savePath = newSavePath;
+      dialog_clear();
+      return true;
+    } else {
+      dialog_keyinput(newSavePath, c, cx);
+    }
+  }
+}
+
+bool save_wait() {
+  // block until the running save is done, keeping its progress on screen
+  while (save_busy() && !save_poll()) {
+    render_status();
+    refresh();
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+  }
+  return save_ok;
+}
+
+bool savingdialog() {
+  // quitting while a save is still going; returns false to stay
+  while (1) {
+    move(LINES - 1, 0);
+    clrtoeol();
+    printw("Still saving; wait for it or cancel it? (w/c/esc) ");
+
+    int c = wgetch(stdscr);
+    if (c == 27) {
+      return false;
+    } else if (c == 'w') {
+      save_wait();
+      return true;
+    } else if (c == 'c') {
+      save_cancel = true;
+      save_wait();
+      return true;
+    }
+  }
+}
+
+bool exitdialog() {
+  while (1) {
+    move(LINES - 1, 0);
+    clrtoeol();
+    printw("Save before exit? (y/n/esc) ");
+
+    int c = wgetch(stdscr);
+    if (c == 27) {
+      return false;
+    } else if (c == 'n') {
+      return true;
+    } else if (c == 'y') {
+      if (savedialog(filePath)) {
+        return save(filePath) && save_wait();  // a failed save doesn't exit
+      }
+    }
+  }
+}
+
+bool goto_byte(const std::string& entry, int* line, int* col) {
+  // "@offset" (decimal, or hex after 0x) or "percent%" to a line and
+  // column; the index is waited for as far as the offset
+  const uint8_t* end = fileBuffer + fileSize;
+  const char* digits = entry.c_str();
+  char* rest = nullptr;
+  uint64_t offset;
+  bool hex = false;
+  if (entry[0] == '@') {
+    hex = entry.compare(1, 2, "0x") == 0 || entry.compare(1, 2, "0X") == 0;
+    digits += hex ? 3 : 1;
+    offset = strtoull(digits, &rest, hex ? 16 : 10);
+  } else {
+    double percent = strtod(digits, &rest);
+    if (*rest != '%' || percent < 0 || percent > 100) {
+      return false;
+    }
+    uint64_t bytes = index_busy() ? fileSize : file_lines.byte_count(end);
+    offset = bytes * percent / 100;
+    rest++;
+  }
+  unsigned char first = *digits;
+  if (rest == digits || *rest != 0 || !(hex ? isxdigit(first) : isdigit(first))) {
+    return false;
+  }
+  while (index_busy() && file_lines.byte_count(end) <= offset) {
+    index_wait_for(file_lines.size() + 1);
+  }
+  *line = file_lines.line_at_byte(offset, end);
+  *col = std::min(offset, file_lines[*line].size);
+  return true;
+}
+
+bool gotodialog(int* line, int* col) {
+  // a line number, a byte offset as "@offset", or "percent%" of the way
+  // through the file
+  std::string s_line;
+  int cx = 0;
+  while (1) {
+    dialog_render("Goto (line, @byte or %): ", s_line, cx);
+    int c = wgetch(stdscr);
+    
+    if (c == 27) {
+      dialog_clear();
+      return false;
+    } else if (c == '\r' || c == '\n' || c == KEY_ENTER) {
+      dialog_clear();
+      if (s_line.empty()) {
+        return false;
+      } else if (s_line[0] == '@' || s_line.back() == '%') {
+        if (!goto_byte(s_line, line, col)) {
+          printcl(1, "Not a byte offset or percentage: %s", s_line.c_str());
+          return false;
+        }
+        return true;
+      }
+      char* rest;
+      long long number = strtoll(s_line.c_str(), &rest, 10);
+      if (!isdigit((unsigned char)s_line[0]) || *rest != 0) {
+        printcl(1, "Not a line number: %s", s_line.c_str());
+        return false;
+      }
+      // past the end is the last line, which the caller clamps to
+      *line = (int)std::min(number, (long long)INT_MAX) - 1;
+      return true;
+    } else if (c < 0x80 && isprint(c) && !strchr("0123456789@%.xXabcdefABCDEF", c)) {
+      // nothing a line number, an offset or a percentage can hold
+    } else {
+      dialog_keyinput(s_line, c, cx, INPUT_DIGITS | INPUT_SYMBOLS | INPUT_ALPHA);
+    }
+  }
+}
+
+void scroll_to_cursor_once() {
+  int y, x;
+  get_cursor(y, x);
+  if (soft_wrap) {
+    // the cursor's row goes at the top or, coming from below, the bottom
+    if (y < 0 || y > LINES - 3) {
+      byte_to_col(cy, cx, first_row);
+      first_line = cy;
+      if (y > LINES - 3) {
+        scroll_file(-(LINES - 3));
+      }
+    }
+    return;
+  }
+  if (y < 0) {
+    scroll_file(y);
+  } else if (y > LINES - 3) {
+    scroll_file((y - (LINES - 3)));
+  }
+
+  // sideways a quarter of the width at a time, so typing along the edge
+  // doesn't shift every row at every key; the last column is for the '$'
+  int row;
+  uint64_t col = byte_to_col(cy, cx, row);
+  uint64_t width = view_width() - 1;
+  if (col < first_col) {
+    first_col = col > width / 4 ? col - width / 4 : 0;
+  } else if (col >= first_col + width) {
+    first_col = col - width + width / 4 + 1;
+  }
+}
+
+void scroll_to_cursor() {
+  // with the margin display_file() will have, which can change as we
+  // scroll and, with soft wrap, moves where the rows break
+  left_margin = line_num_digits() + 1;
+  scroll_to_cursor_once();
+  if (left_margin != line_num_digits() + 1) {
+    left_margin = line_num_digits() + 1;
+    scroll_to_cursor_once();
+  }
+}
+
+void cursor_row_step(bool down) {
+  // with soft wrap Up and Down go by screen rows, keeping to the column
+  // they started from across shorter rows on the way
+  int row;
+  uint64_t col = byte_to_col(cy, cx, row);
+  if (cy != preferred_col_cy || cx != preferred_col_cx) {
+    preferred_col = col;  // moved some other way since
+  }
+  int line = cy;
+  if (down ? next_row(line, row) : prev_row(line, row)) {
+    cy = line;
+    cx = col_to_byte(line, row, preferred_col);
+  }
+  preferred_col_cy = cy;
+  preferred_col_cx = cx;
+}
+
+uint64_t find_line_home(int line) {
+  // Return either the start of line (after whitespace) or
+  // that of the last non-blank line
+  assert(line < file_lines.size());
+  LineMeta meta = file_lines[line];
+  for (uint64_t i = 0; i < meta.size; i++) {
+    uint8_t c = meta.at(i);
+    if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+      return i;
+    }
+  }
+  if (line == 0) return 0;
+  return find_line_home(line - 1);
+}
+
+// Find as you type.  A search runs forward from where it began, wrapping
+// around at the end of the file.  Unedited lines that still lie one line
+// break apart in fileBuffer are scanned as one run, so the finder sees
+// big stretches of text at a time; edited lines are copied out one by
+// one.  A typed character narrows the search instead of restarting it:
+// every match of the longer needle is a match of the shorter one, so the
+// scan carries on from the shorter needle's match.  The scan breaks off
+// as soon as a key is waiting and is taken up again once it is handled.
+struct FindState {
+  std::string needle;
+  uint64_t line, col;  // the match, or where the scan got to
+  bool wrapped;        // come round from the end of the file
+  bool done;           // found, or searched all the way round
+  bool found;
+};
+
+uint64_t find_origin_line = 0, find_origin_col = 0;  // where the search began
+
+bool input_pending() {
+  // curses may already have read keys off the terminal (the rest of a
+  // burst, or one pushed back), where poll can't see them
+  nodelay(stdscr, TRUE);
+  int c = wgetch(stdscr);
+  nodelay(stdscr, FALSE);
+  if (c != ERR) {
+    MEVENT event;
+    if (c != KEY_MOUSE) {
+      ungetch(c);
+    } else if (getmouse(&event) == OK) {
+      ungetmouse(&event);
+    }
+    return true;
+  }
+  pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+  return poll(&pfd, 1, 0) > 0;
+}
+
+bool follows_line_break(const uint8_t* end, const uint8_t* next) {
+  // true if next starts just past the line break at end
+  if (next == end + 1) {
+    return *end == '\n' || *end == '\r';
+  }
+  return next == end + 2 && end[0] == '\r' && end[1] == '\n';
 }
 
-bool savedialog(std::string& savePath) {
-  std::string newSavePath = savePath;
-  int cx = savePath.size();
+bool find_in_lines(const std::string& needle, uint64_t& line, uint64_t& col,
+                   uint64_t end_line, bool& interrupted) {
+  // look for needle from (line, col) up to end_line; line and col are left
+  // on the match, or where the scan stopped
+  const uint64_t RUN_SIZE = 1024 * 1024;  // bytes scanned between checks for keys
+  assert(needle.find_first_of("\r\n") == std::string::npos);
+  std::vector<uint8_t> copy;
+  std::vector<uint64_t> line_offset;  // where each line of a run starts in it
+  LineTree::iterator it = file_lines.begin(line);
+  uint64_t skip = col;
+  uint64_t scanned = 0;
+  while (it.line() < end_line) {
+    if (scanned >= RUN_SIZE) {
+      if (input_pending()) {
+        interrupted = true;
+        line = it.line();
+        col = skip;
+        return false;
+      }
+      scanned = 0;
+    }
+
+    uint64_t run_line = it.line();
+    const uint8_t* run;
+    uint64_t run_size;
+    line_offset.clear();
+    if (it->has_edit_buffer()) {
+      copy.resize(it->size);
+      it->copy_out(copy.data(), 0, it->size);
+      run = copy.data();
+      run_size = it->size;
+      line_offset.push_back(0);
+      ++it;
+    } else {
+      // the needle has no line breaks, so it can't match across the ones
+      // between the lines of a run
+      run = it->start;
+      file_touch(run);
+      do {
+        line_offset.push_back(it->start - run);
+        run_size = it->start + it->size - run;
+        ++it;
+      } while (it.line() < end_line && !it->has_edit_buffer() && run_size < RUN_SIZE &&
+               follows_line_break(run + run_size, it->start));
+    }
+    scanned += run_size + line_offset.size();
+
+    assert(skip <= run_size);
+    const uint8_t* match = find_substring(run + skip, run_size - skip,
+                                          (const uint8_t*)needle.data(), needle.size());
+    skip = 0;
+    if (match) {
+      uint64_t offset = match - run;
+      uint64_t i = std::upper_bound(line_offset.begin(), line_offset.end(), offset) -
+                   line_offset.begin() - 1;
+      line = run_line + i;
+      col = offset - line_offset[i];
+      return true;
+    }
+  }
+  line = end_line;
+  col = 0;
+  return false;
+}
+
+void find_step(FindState& state) {
+  // carry on with a search until it is done or a key comes in
+  bool interrupted = false;
+  if (!state.done && !state.wrapped) {
+    if (find_in_lines(state.needle, state.line, state.col, file_lines.size(), interrupted)) {
+      state.done = state.found = true;
+      return;
+    }
+    if (interrupted) {
+      return;
+    }
+    state.wrapped = true;
+    state.line = 0;
+    state.col = 0;
+  }
+  if (!state.done) {
+    // back round to where we began; a match from there on was seen first time round
+    bool found = find_in_lines(state.needle, state.line, state.col, find_origin_line + 1,
+                               interrupted);
+    if (found && (state.line < find_origin_line || state.col < find_origin_col)) {
+      state.done = state.found = true;
+    } else if (!interrupted) {
+      state.done = true;
+      state.found = false;
+    }
+  }
+}
+
+void find_show(const std::string& entry, int cursor, const FindState* state) {
+  // put the cursor on the match, or back where the search began
+  if (find_match_line >= 0) {
+    damage_line(find_match_line);
+  }
+  find_match_line = -1;
+  cy = find_origin_line;
+  cx = find_origin_col;
+  if (state && state->found) {
+    find_match_line = state->line;
+    find_match_col = state->col;
+    find_match_size = state->needle.size();
+    damage_line(find_match_line);
+    cy = state->line;
+    cx = state->col;
+  }
+  scroll_to_cursor();
+  update_screen();
 
+  dialog_render("Find: ", entry, cursor);
+  const char* status = nullptr;
+  if (state && !state->done) {
+    status = "searching\xe2\x80\xa6";
+  } else if (state && !state->found) {
+    status = "not found";
+  }
+  if (status) {
+    mvprintw(LINES - 1, 6 + entry.size() + 2, "[ %s ]", status);
+    move(LINES - 1, 6 + cursor);
+  }
+  refresh();
+}
+
+bool finddialog() {
+  // Ctrl-F again goes to the next match; Esc goes back to where we were
+  index_wait_for(UINT64_MAX);
+  int start_cy = cy, start_cx = cx, start_first_line = first_line, start_first_row = first_row;
+  uint64_t start_first_col = first_col;
+  find_origin_line = cy;
+  find_origin_col = cx;
+  std::string entry;
+  int cursor = 0;
+  std::vector<FindState> states;  // each needle is a prefix of the next
   while (1) {
-    dialog_render("Filename: ", newSavePath, cx);
+    FindState* state = states.size() ? &states.back() : nullptr;
+    find_show(entry, cursor, state);
+    if (state && !state->done) {
+      find_step(*state);
+      if (state->done) {
+        continue;
+      }
+    }
     int c = wgetch(stdscr);
 
-    if (c == 27) {
-      dialog_clear();
-      return false;
-    } else if (c == '\r' || c == '\n' || c == KEY_ENTER) {
-      savePath = newSavePath;
+    if (c == 27 || c == '\r' || c == '\n' || c == KEY_ENTER) {
+      bool accept = (c != 27) && state && state->found;
+      if (!accept) {
+        cy = start_cy;
+        cx = start_cx;
+        first_line = start_first_line;
+        first_row = start_first_row;
+        first_col = start_first_col;
+      }
+      if (find_match_line >= 0) {
+        damage_line(find_match_line);
+        find_match_line = -1;
+      }
       dialog_clear();
-      return true;
+      return accept;
+    } else if (c == CTRL('F')) {
+      if (state && state->found) {
+        // start again just past this match
+        find_origin_line = state->line;
+        find_origin_col = state->col + 1;
+        FindState next = { entry, find_origin_line, find_origin_col, false, false, false };
+        states.assign(1, next);
+      }
     } else {
-      dialog_keyinput(newSavePath, c, cx);
+      dialog_keyinput(entry, c, cursor);
+      while (states.size() &&
+             entry.compare(0, states.back().needle.size(), states.back().needle) != 0) {
+        states.pop_back();
+      }
+      if (entry.size() && (states.empty() || states.back().needle != entry)) {
+        FindState next = { entry, find_origin_line, find_origin_col, false, false, false };
+        if (states.size()) {
+          // nothing to find if the shorter needle wasn't there
+          const FindState& prefix = states.back();
+          next.line = prefix.line;
+          next.col = prefix.col;
+          next.wrapped = prefix.wrapped;
+          next.done = prefix.done && !prefix.found;
+        }
+        states.push_back(next);
+      }
     }
   }
 }
 
-bool exitdialog() {
+bool regexdialog() {
+  // start a regex search; an empty one ends the search
+  std::string entry = search_pattern;
+  int cursor = entry.size();
   while (1) {
-    move(LINES - 1, 0);
-    clrtoeol();
-    printw("Save before exit? (y/n/esc) ");
-
+    dialog_render("Regex: ", entry, cursor);
     int c = wgetch(stdscr);
+
     if (c == 27) {
+      dialog_clear();
       return false;
-    } else if (c == 'n') {
-      return true;
-    } else if (c == 'y') {
-      if (savedialog(filePath)) {
-        save(filePath);
-        return true;
+    } else if (c == '\r' || c == '\n' || c == KEY_ENTER) {
+      dialog_clear();
+      if (entry.empty()) {
+        search_pattern.clear();
+        search_stop();
+        return false;
       }
+      return search_start(entry);
+    } else {
+      dialog_keyinput(entry, c, cursor);
     }
   }
 }
 
-bool gotodialog(int* line) {
-  std::string s_line;
-  int cx = 0;
+bool replacedialog() {
+  // what to replace and what with; Esc at either prompt cancels
+  std::string pattern = search_pattern, replacement;
+  std::string* entry = &pattern;
+  int cursor = pattern.size();
   while (1) {
-    dialog_render("Goto: ", s_line, cx);
+    dialog_render(entry == &pattern ? "Replace: " : "With: ", *entry, cursor);
     int c = wgetch(stdscr);
-    
+
     if (c == 27) {
       dialog_clear();
       return false;
     } else if (c == '\r' || c == '\n' || c == KEY_ENTER) {
-      if (s_line.size()) {
-        *line = std::stoi(s_line) - 1;
-        dialog_clear();
-        return true;
-      } else {
-        dialog_clear();
-        return false;
+      if (entry == &pattern) {
+        if (pattern.size()) {
+          entry = &replacement;
+          cursor = 0;
+        }
+        continue;
       }
+      dialog_clear();
+      return replace_all(pattern, replacement);
     } else {
-      dialog_keyinput(s_line, c, cx, INPUT_DIGITS);
+      dialog_keyinput(*entry, c, cursor);
     }
   }
 }
 
-template<typename... Args>
-void strprintf(std::string& s, const char* fmt, Args&&... args) {
-  int string_size = snprintf(nullptr, 0, fmt, args...);
-  s.reserve(string_size + 1);
-  snprintf(&s[0], string_size + 1, fmt, args...);
-}
+// Keys that arrive faster than we draw are applied in a batch with one
+// frame at the end (times in ms)
+const int MIN_FRAME_INTERVAL = 16;  // at most ~60 frames a second
+const int MAX_FRAME_DELAY = 50;     // draw at least this often under input
 
-template<typename... Args>
-void printcl(int level, const char* fmt, Args&&... args) {
-  cl_message_time = time(nullptr);
-  cl_message_level = level;
-  strprintf(cl_message, fmt, args...);
-}
+const int PASTE_TIMEOUT = 1000;     // give up on a paste that never ends
 
-void scroll_to_cursor() {
-  int y, x;
-  get_cursor(y, x);
-  if (y < 0) {
-    scroll_file(y);
-  } else if (y > LINES - 3) {
-    scroll_file((y - (LINES - 3)));
-  }
-}
+bool handle_key(int c) {
+  // apply one key; returns false when the editor should quit
+  timeout(-1);  // dialogs wait for their keys
+  undo_action++;
+  if (c == ERR) {
+    // timed out; just redraw
+  } else if (c >= ' ' && c <= '~') {  // all printable chars
+    putc(c, cy, cx);
+    cx++;
+    preferred_cx = cx;
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == KEY_UP) {
+    if (soft_wrap) {
+      cursor_row_step(false);
+    } else {
+      //scroll_file(-1);
+      cy--;
+      if (cy < 0) cy = 0;
+      if (preferred_cx > file_lines[cy].size) {
+        cx = file_lines[cy].size;
+      } else {
+        cx = preferred_cx;
+      }
+    }
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == KEY_DOWN) {
+    if (soft_wrap) {
+      cursor_row_step(true);
+    } else {
+      //scroll_file(1);
+      cy++;
+      if (cy >= file_lines.size()) cy = file_lines.size() - 1;
+      if (preferred_cx > file_lines[cy].size) {
+        cx = file_lines[cy].size;
+      } else {
+        cx = preferred_cx;
+      }
+    }
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == KEY_LEFT) {
+    if (cx > 0) {
+      cx--;
+    } else if (cy > 0) {
+      cy--;
+      cx = file_lines[cy].size;
+    }
+    preferred_cx = cx;
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == KEY_RIGHT) {
+    if (cx < file_lines[cy].size) {
+      cx++;
+    } else if (cy < file_lines.size() - 1) {
+      cy++;
+      cx = 0;
+    }
+    preferred_cx = cx;
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == KEY_CTRL_LEFT) {
+    preferred_cx = cx;
+    cut_sequence = false;
+    printcl(1, "go to previous token");
+  } else if (c == KEY_CTRL_RIGHT) {
+    preferred_cx = cx;
+    cut_sequence = false;
+    printcl(1, "go to next token");
+  } else if (c == KEY_HOME) {
+    int home = find_line_home(cy);
+    if (cx == home) {
+      cx = 0;
+    } else {
+      cx = home;
+    }
+    preferred_cx = cx;
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == KEY_END) {
+    cx = file_lines[cy].size;
+    preferred_cx = cx;
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == KEY_CTRL_HOME) {
+    cx = 0;
+    cy = 0;
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == KEY_CTRL_END) {
+    index_wait_for(UINT64_MAX);
+    cy = file_lines.size() - 1;
+    cx = file_lines[cy].size;
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == KEY_NPAGE) {
+    scroll_file(4);
+    cut_sequence = false;
+  } else if (c == KEY_PPAGE) {
+    scroll_file(-4);
+  } else if (c == CTRL('q')) {
+    if (save_busy() && !savingdialog()) {
+      return true;
+    }
+    if (!dirty || exitdialog()) {
+      return false;
+    }
+  } else if (c == CTRL('S')) {
+    if (savedialog(filePath)) {
+      save(filePath);
+    }
+  } else if (c == CTRL('K')) {
+    if (!cut_sequence) {
+      clear_cutbuffer();
+    }
+    cut_sequence = true;
+    index_wait_for(cy + 2);  // the line after, so the cursor has somewhere to go
+    cut_line(cy);
+    if (cy >= file_lines.size()) {
+      cy = file_lines.size() - 1;
+    }
+    if (cy < 0) cy = 0;
+    if (cx > file_lines[cy].size) {
+      cx = file_lines[cy].size;
+    }
+    scroll_to_cursor();
+  } else if (c == CTRL('U')) {
+    insert_cutbuffer(cy);
+    cy += cutbuffer.size();
+    if (cx > file_lines[cy].size) {
+      cx = file_lines[cy].size;
+    }
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == CTRL('G')) {
+    if (gotodialog(&cy, &cx)) {
+      if (cy < 0) cy = 0;
+      index_wait_for(cy + 1);
+      if (cy >= file_lines.size()) cy = file_lines.size() - 1;
+      if (cx > file_lines[cy].size) {
+        cx = file_lines[cy].size;
+      }
+    }
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == CTRL('F')) {
+    finddialog();
+    preferred_cx = cx;
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == CTRL('E')) {
+    regexdialog();
+    cut_sequence = false;
+  } else if (c == CTRL('R')) {
+    replacedialog();
+    if (cx > file_lines[cy].size) {
+      cx = file_lines[cy].size;
+    }
+    preferred_cx = cx;
+    cut_sequence = false;
+  } else if (c == CTRL('N') || c == CTRL('P')) {
+    MatchIndex::Match m;
+    if (search_matches.next(cy, cx, c == CTRL('N'), m)) {
+      cy = m.line;
+      cx = m.col;
+    } else {
+      printcl(0, search_active ? "No matches" : "No regex search (Ctrl-E)");
+    }
+    preferred_cx = cx;
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == KEY_RESIZE) {
+    printcl(0, "[ Cols: %d Rows : %d ]", COLS, LINES);
+    regenerate_screen();
+  } else if (c == CTRL('Z') || c == CTRL('Y')) {
+    bool done = (c == CTRL('Z')) ? undo(cy, cx) : redo(cy, cx);
+    if (!done) {
+      printcl(0, (c == CTRL('Z')) ? "Nothing to undo" : "Nothing to redo");
+    }
+    if (cy >= file_lines.size()) cy = file_lines.size() - 1;
+    if (cx > file_lines[cy].size) {
+      cx = file_lines[cy].size;
+    }
+    preferred_cx = cx;
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == KEY_F(2)) {
+    stats_visible = !stats_visible;
+    cl_message_time = 0;
+  } else if (c == KEY_F(3)) {
+    soft_wrap = !soft_wrap;
+    layouts.clear();
+    first_row = 0;
+    first_col = 0;
+    scroll_to_cursor();
+    damage_all();
+    printcl(0, "Soft wrap %s", soft_wrap ? "on" : "off");
+  } else if (c == KEY_F(12)) {
+    bracketed_paste(false);
+    endwin();
+    raise(SIGSTOP);
+    bracketed_paste(true);
+    regenerate_screen();
+  } else if (c == KEY_BACKSPACE) {
+    if (cx > 0) {
+      removec(cy, cx - 1);
+      cx--;
+    } else if (cy > 0) {
+      cx = file_lines[cy - 1].size;
+      combine_lines(cy - 1, cy);
+      cy--;
+    }
+    preferred_cx = cx;
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == KEY_DC) {
+    if (cx < file_lines[cy].size) {
+      removec(cy, cx);
+    } else if (cy < file_lines.size() - 1) {
+      combine_lines(cy, cy + 1);
+    }
+    preferred_cx = cx;
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == '\r' || c == '\n' || c == KEY_ENTER) {
+    putnl(cy, cx);
+    cy++;
+    cx = find_line_home(cy);
+    preferred_cx = cx;
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == KEY_PASTE_BEGIN) {
+    // the terminal sends pasted text between two markers; collect it all
+    // and insert it as one block rather than key by key
+    std::vector<uint8_t> text;
+    timeout(PASTE_TIMEOUT);
+    while ((c = wgetch(stdscr)) != KEY_PASTE_END && c != ERR) {
+      if (c < 0x100) {
+        text.push_back(c);
+      }
+    }
+    uint64_t added = paste_text(cy, cx, text.data(), text.size());
+    cy += added;
+    LineMeta line_meta = file_lines[cy];
+    if (added) {
+      // the text after the cursor went on the end of the last line
+      cx = 0;
+      for (uint64_t i = text.size(); i > 0 && text[i - 1] != '\r' && text[i - 1] != '\n'; i--) {
+        cx++;
+      }
+    } else {
+      cx += text.size();
+    }
+    assert(cx <= line_meta.size);
+    preferred_cx = cx;
+    scroll_to_cursor();
+    cut_sequence = false;
+  } else if (c == KEY_MOUSE) {
+    MEVENT event;
+    cut_sequence = false;
+    if (getmouse(&event) == OK) {
+      //printcl(1, "mouse: x=%d y=%d z=%d bstate=0x%08x", event.x, event.y, event.z, (uint32_t)event.bstate);
 
-uint64_t find_line_home(int line) {
-  // Return either the start of line (after whitespace) or
-  // that of the last non-blank line
-  assert(line < file_lines.size());
-  LineMeta meta = file_lines[line];
-  for (uint64_t i = 0; i < meta.size; i++) {
-    uint8_t c = meta.start[i];
-    if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
-      return i;
+      if (BUTTON_PRESS(event.bstate, 1)) {
+        if (event.y < LINES - 2) {
+          screen_to_file(event.y, event.x, cy, cx);
+          if (cy >= file_lines.size()) cy = file_lines.size() - 1;
+          LineMeta line = file_lines[cy];
+          if (cx > line.size) cx = line.size;
+          preferred_cx = cx;
+        }
+      } else if (MOUSE_SCROLL_UP(event.bstate)) {
+        scroll_file(-4);
+      } else if (MOUSE_SCROLL_DN(event.bstate)) {
+        scroll_file(4);
+      }
     }
+  } else {
+    printcl(0, "wgetch=%d", c);
   }
-  if (line == 0) return 0;
-  return find_line_home(line - 1);
+  return true;
+}
+
+void usage() {
+  fprintf(stderr, "Usage: qe [-j threads] [-u undo MiB] [-m memory MiB] [-c index cache MiB] [-w] [filename]\n");
 }
 
 int main(int argc, char* argv[]) {
-  if (argc < 2) {
+  int opt;
+  while ((opt = getopt(argc, argv, "j:u:m:c:w")) != -1) {
+    if (opt == 'j') {
+      char* end;
+      errno = 0;
+      unsigned long threads = strtoul(optarg, &end, 10);
+      if (!isdigit((unsigned char)optarg[0]) || *end || errno || threads > MAX_INDEX_THREADS) {
+        fprintf(stderr, "qe: -j takes a thread count from 0 (one per core) to %u\n", MAX_INDEX_THREADS);
+        usage();
+        return -1;
+      }
+      index_threads = threads;
+    } else if (opt == 'u') {
+      undo_budget = strtoull(optarg, nullptr, 10) * 1024 * 1024;
+    } else if (opt == 'm') {
+      memory_budget = strtoull(optarg, nullptr, 10) * 1024 * 1024;
+      large_file = true;
+    } else if (opt == 'c') {
+      index_cache_budget = strtoull(optarg, nullptr, 10) * 1024 * 1024;
+    } else if (opt == 'w') {
+      soft_wrap = true;
+    } else {
+      usage();
+      return -1;
+    }
+  }
+  if (index_threads == 0) {
+    index_threads = std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  if (optind >= argc) {
   //  fprintf(stderr, "Usage: qe <filename>\n");
   //  return -1;
-    LineMeta line = {0};
+    LineMeta line = {};
     file_lines.push_back(line);
   } else {
 
-  filePath = argv[1];
-  const char* cFilePath = argv[1];
+  filePath = argv[optind];
+  syntax = find_syntax(filePath);
+  const char* cFilePath = argv[optind];
   file = fopen(cFilePath, "rb");
   if (!file) {
     fprintf(stderr, "Could not open file '%s' for editing.\n", cFilePath);
     return -1;
   }
 
-  uint64_t fileSize = file_get_size(file);
-
-  fileBuffer = new uint8_t[fileSize];
-  fread(fileBuffer, 1, fileSize, file);
+  fileSize = file_get_size(file);
+  fileBuffer = file_map(file, fileSize, fileMapped);
+  if (fileSize > 0 && !fileBuffer) {
+    fprintf(stderr, "Could not read file '%s'.\n", cFilePath);
+    return -1;
+  }
+  // a file over half the memory there is goes in large-file mode, with a
+  // quarter of memory to work in unless -m says otherwise
+  uint64_t memory = (uint64_t)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+  large_file = fileMapped && (large_file || fileSize > memory / 2);
+  if (memory_budget == 0) {
+    memory_budget = memory / 4;
+  }
 
   // initialise line data
-  uint8_t* cp = fileBuffer;
+  auto index_begin = std::chrono::steady_clock::now();
+  uint8_t* line_start = fileBuffer;
   uint8_t* fileBufferEnd = fileBuffer + fileSize;
-  while (1) {
-    LineMeta line = {0};
-    line.start = cp;
 
-    char c = *cp++;
-    while (c != '\r' && c != '\n' && cp <= fileBufferEnd) {
-      line.size++;
-      c = *cp++;
-    }
-    if (c == '\r') {
-      if (*cp == '\n') {
-        c = *cp++;
-      }
+  if (index_cache_open(file) && index_cache_load()) {
+    std::chrono::duration<double, std::milli> index_time = std::chrono::steady_clock::now() - index_begin;
+    printcl(0, "Indexed %llu lines from the cache in %.1f ms",
+            (unsigned long long)file_lines.size(), index_time.count());
+  } else {
+    // index enough to fill the first screen now, and the rest in the background
+    const uint64_t FIRST_SCREEN_LINES = 512;
+    const uint64_t FIRST_SCREEN_STEP = 64 * 1024;
+    std::vector<LineMeta> first_screen;
+    uint8_t* cp = fileBuffer;
+    while (cp < fileBufferEnd && first_screen.size() < FIRST_SCREEN_LINES) {
+      uint8_t* to = cp + std::min(FIRST_SCREEN_STEP, (uint64_t)(fileBufferEnd - cp));
+      index_lines(cp, to, fileBufferEnd, line_start, first_screen);
+      cp = to;
     }
-
-    file_lines.push_back(line);
-    if (cp >= fileBufferEnd) {
-      char ce = *(fileBufferEnd - 1);
-      if (ce == '\r' || ce == '\n') {
-        line = {0};
-        file_lines.push_back(line);
-      }
-      break;
+    file_lines.append(first_screen.data(), first_screen.data() + first_screen.size(), fileBufferEnd);
+    if (cp < fileBufferEnd) {
+      index_running = true;
+      index_bytes_done = cp - fileBuffer;
+      index_thread = std::thread(index_background, cp, line_start, index_begin);
+    } else {
+      LineMeta last_line = {};
+      last_line.start = line_start;
+      last_line.size = fileBufferEnd - line_start;
+      file_lines.push_back(last_line);
+      std::chrono::duration<double, std::milli> index_time = std::chrono::steady_clock::now() - index_begin;
+      printcl(0, "Indexed %llu lines in %.1f ms (%u threads)",
+              (unsigned long long)file_lines.size(), index_time.count(), 1);
     }
   }
 
@@ -627,6 +5991,10 @@ int main(int argc, char* argv[]) {
   set_escdelay(0);
   mouseinterval(0);  // Skip test for 'clicked' so that 'pressed' and 'released' are snappy
   keypad(stdscr, TRUE);   // Get special keys too (Fn, arrows, etc.)
+  idlok(stdscr, TRUE);    // Scroll with the terminal's insert/delete line
+  define_key("\033[200~", KEY_PASTE_BEGIN);
+  define_key("\033[201~", KEY_PASTE_END);
+  bracketed_paste(true);
   mousemask(ALL_MOUSE_EVENTS, nullptr);
 
   start_color();
@@ -636,6 +6004,25 @@ int main(int argc, char* argv[]) {
   init_pair(COLOR_PAIR_LINENUM_SHADED, COLOR_PINK, COLOR_LINE_SHADE);
   init_pair(COLOR_PAIR_LINE_SHADED, COLOR_WHITE, COLOR_LINE_SHADE);
   init_pair(COLOR_PAIR_ERROR, COLOR_BLACK, COLOR_RED);
+  init_color(COLOR_GRAY, 600, 600, 600);
+  const short syntax_colors[HL_COUNT] = {
+    COLOR_WHITE,    // HL_NONE
+    COLOR_YELLOW,   // HL_KEYWORD
+    COLOR_CYAN,     // HL_TYPE
+    COLOR_MAGENTA,  // HL_PREPROC
+    COLOR_GRAY,     // HL_COMMENT
+    COLOR_GREEN,    // HL_STRING
+    COLOR_PINK,     // HL_NUMBER
+    COLOR_CYAN,     // HL_KEY
+    COLOR_RED,      // HL_ERROR
+    COLOR_YELLOW,   // HL_WARNING
+    COLOR_GREEN,    // HL_INFO
+    COLOR_GRAY,     // HL_DEBUG
+  };
+  for (int kind = 0; kind < HL_COUNT; kind++) {
+    init_pair(COLOR_PAIR_SYNTAX + kind, syntax_colors[kind], COLOR_BLACK);
+    init_pair(COLOR_PAIR_SYNTAX_SHADED + kind, syntax_colors[kind], COLOR_LINE_SHADE);
+  }
 
   regenerate_screen();
   set_cursor();
@@ -646,195 +6033,71 @@ int main(int argc, char* argv[]) {
   deed.sa_handler = handle_sigcont;
   sigaction(SIGCONT, &deed, NULL);
 
+  auto last_frame = std::chrono::steady_clock::now();
   while (1) {
+    // wake up now and then to pick up lines from the background indexer,
+    // follow a save and take in search results, and soon if highlighting
+    // on screen is still to finish
+    if (lex_pending()) {
+      timeout(MIN_FRAME_INTERVAL);
+    } else {
+      timeout(index_busy() || save_busy() || search_busy() ? 100 : -1);
+    }
     int c = wgetch(stdscr);
+    index_poll();
+    save_poll();
+    search_poll();
     if (window_resized) {
       regenerate_screen();
     }
 
-    if (c >= ' ' && c <= '~') {  // all printable chars
-      putc(c, cy, cx);
-      cx++;
-      preferred_cx = cx;
-      scroll_to_cursor();
-      cut_sequence = false;
-    } else if (c == KEY_UP) {
-      //scroll_file(-1);
-      cy--;
-      if (cy < 0) cy = 0;
-      if (preferred_cx > file_lines[cy].size) {
-        cx = file_lines[cy].size;
-      } else {
-        cx = preferred_cx;
-      }
-      scroll_to_cursor();
-      cut_sequence = false;
-    } else if (c == KEY_DOWN) {
-      //scroll_file(1);
-      cy++;
-      if (cy >= file_lines.size()) cy = file_lines.size() - 1;
-      if (preferred_cx > file_lines[cy].size) {
-        cx = file_lines[cy].size;
-      } else {
-        cx = preferred_cx;
-      }
-      scroll_to_cursor();
-      cut_sequence = false;
-    } else if (c == KEY_LEFT) {
-      if (cx > 0) {
-        cx--;
-      } else if (cy > 0) {
-        cy--;
-        cx = file_lines[cy].size;
-      }
-      preferred_cx = cx;
-      scroll_to_cursor();
-      cut_sequence = false;
-    } else if (c == KEY_RIGHT) {
-      if (cx < file_lines[cy].size) {
-        cx++;
-      } else if (cy < file_lines.size() - 1) {
-        cy++;
-        cx = 0;
-      }
-      preferred_cx = cx;
-      scroll_to_cursor();
-      cut_sequence = false;
-    } else if (c == KEY_CTRL_LEFT) {
-      preferred_cx = cx;
-      cut_sequence = false;
-      printcl(1, "go to previous token");
-    } else if (c == KEY_CTRL_RIGHT) {
-      preferred_cx = cx;
-      cut_sequence = false;
-      printcl(1, "go to next token");
-    } else if (c == KEY_HOME) {
-      int home = find_line_home(cy);
-      if (cx == home) {
-        cx = 0;
-      } else {
-        cx = home;
-      }
-      preferred_cx = cx;
-      cut_sequence = false;
-    } else if (c == KEY_END) {
-      cx = file_lines[cy].size;
-      preferred_cx = cx;
-      cut_sequence = false;
-    } else if (c == KEY_CTRL_HOME) {
-      cx = 0;
-      cy = 0;
-      scroll_to_cursor();
-      cut_sequence = false;
-    } else if (c == KEY_CTRL_END) {
-      cy = file_lines.size() - 1;
-      cx = file_lines[cy].size;
-      scroll_to_cursor();
-      cut_sequence = false;
-    } else if (c == KEY_NPAGE) {
-      scroll_file(4);
-      cut_sequence = false;
-    } else if (c == KEY_PPAGE) {
-      scroll_file(-4);
-    } else if (c == CTRL('q')) {
-      if (!dirty || exitdialog()) {
-        endwin();
-        return 0;
-      }
-    } else if (c == CTRL('S')) {
-      if (savedialog(filePath)) {
-        save(filePath);
-      }
-    } else if (c == CTRL('K')) {
-      if (!cut_sequence) {
-        clear_cutbuffer();
-      }
-      cut_sequence = true;
-      cut_line(cy);
-      if (cy >= file_lines.size()) {
-        cy = file_lines.size() - 1;
-      }
-      if (cx > file_lines[cy].size) {
-        cx = file_lines[cy].size;
-      }
-      scroll_to_cursor();
-    } else if (c == CTRL('U')) {
-      insert_cutbuffer(cy);
-      cy += cutbuffer.size();
-      if (cx > file_lines[cy].size) {
-        cx = file_lines[cy].size;
+    if (!handle_key(c)) {
+      break;
+    }
+
+    // apply whatever else is already queued before drawing, but draw at
+    // least every MAX_FRAME_DELAY ms while input keeps coming and no more
+    // often than every MIN_FRAME_INTERVAL ms
+    auto now = std::chrono::steady_clock::now();
+    auto batch_end = now + std::chrono::milliseconds(MAX_FRAME_DELAY);
+    auto frame_due = last_frame + std::chrono::milliseconds(MIN_FRAME_INTERVAL);
+    bool quit = false;
+    while (now < batch_end) {
+      int wait = std::chrono::duration_cast<std::chrono::milliseconds>(frame_due - now).count();
+      timeout(std::max(wait, 0));
+      c = wgetch(stdscr);
+      if (c == ERR) {
+        break;
       }
-      scroll_to_cursor();
-      cut_sequence = false;
-    } else if (c == CTRL('G')) {
-      if (gotodialog(&cy)) {
-        if (cy < 0) cy = 0;
-        if (cy >= file_lines.size()) cy = file_lines.size() - 1;
-        if (cx > file_lines[cy].size) {
-          cx = file_lines[cy].size;
+      if (c == KEY_MOUSE || c == KEY_RESIZE) {
+        // these refer to the screen as it is, so draw what we have first;
+        // a mouse event goes back along with its data
+        MEVENT event;
+        if (c != KEY_MOUSE) {
+          ungetch(c);
+        } else if (getmouse(&event) == OK) {
+          ungetmouse(&event);
         }
+        break;
       }
-      scroll_to_cursor();
-      cut_sequence = false;
-    } else if (c == KEY_RESIZE) {
-      printcl(0, "[ Cols: %d Rows : %d ]", COLS, LINES);
-      regenerate_screen();
-    } else if (c == KEY_F(12)) {
-      endwin();
-      raise(SIGSTOP);
-      regenerate_screen();
-    } else if (c == KEY_BACKSPACE) {
-      if (cx > 0) {
-        removec(cy, cx - 1);
-        cx--;
-      } else if (cy > 0) {
-        cx = file_lines[cy - 1].size;
-        combine_lines(cy - 1, cy);
-        cy--;
-      }
-      preferred_cx = cx;
-      scroll_to_cursor();
-      cut_sequence = false;
-    } else if (c == KEY_DC) {
-      if (cx < file_lines[cy].size) {
-        removec(cy, cx);
-      } else if (cy < file_lines.size() - 1) {
-        combine_lines(cy, cy + 1);
-      }
-      preferred_cx = cx;
-      scroll_to_cursor();
-      cut_sequence = false;
-    } else if (c == '\r' || c == '\n' || c == KEY_ENTER) {
-      putnl(cy, cx);
-      cy++;
-      cx = find_line_home(cy);
-      preferred_cx = cx;
-      scroll_to_cursor();
-      cut_sequence = false;
-    } else if (c == KEY_MOUSE) {
-      MEVENT event;
-      cut_sequence = false;
-      if (getmouse(&event) == OK) {
-        //printcl(1, "mouse: x=%d y=%d z=%d bstate=0x%08x", event.x, event.y, event.z, (uint32_t)event.bstate);
-
-        if (BUTTON_PRESS(event.bstate, 1)) {
-          if (event.y < LINES - 2) {
-            screen_to_file(event.y, event.x, cy, cx);
-            if (cy >= file_lines.size()) cy = file_lines.size() - 1;
-            LineMeta line = file_lines[cy];
-            if (cx > line.size) cx = line.size;
-            preferred_cx = cx;
-          }
-        } else if (MOUSE_SCROLL_UP(event.bstate)) {
-          scroll_file(-4);
-        } else if (MOUSE_SCROLL_DN(event.bstate)) {
-          scroll_file(4);
-        }
+      if (!handle_key(c)) {
+        quit = true;
+        break;
       }
-    } else {
-      printcl(0, "wgetch=%d", c);
+      now = std::chrono::steady_clock::now();
     }
+    if (quit) {
+      break;
+    }
+    large_file_trim();
     update_screen();
     set_cursor();
+    last_frame = std::chrono::steady_clock::now();
   }
+
+  index_stop();
+  search_stop();
+  bracketed_paste(false);
+  endwin();
+  return 0;
 }